@@ -0,0 +1,207 @@
+#include <iostream>
+
+#include "headings.h"
+#include "APSEthernet.h"
+
+#include <concol.h>
+
+using namespace std;
+
+// Transport microbenchmarks; these run entirely on the host and don't need an APS2 attached
+
+// count every heap allocation made by the process (including inside libaps2) so we can report allocations per packet
+static std::atomic<size_t> allocationCount(0);
+
+void * operator new(size_t size) {
+  allocationCount++;
+  void * ptr = malloc(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void * ptr) noexcept {
+  free(ptr);
+}
+
+// command options functions taken from:
+// http://stackoverflow.com/questions/865668/parse-command-line-arguments
+string getCmdOption(char ** begin, char ** end, const std::string & option)
+{
+  char ** itr = std::find(begin, end, option);
+  if (itr != end && ++itr != end)
+  {
+    return string(*itr);
+  }
+  return "";
+}
+
+// The packet as it was before payloads were stored inline and serialized into wire buffers: a vector payload,
+// serialized into a freshly allocated vector and parsed from a vector copy of the datagram. Kept here so the "before"
+// cases measure the old code rather than the new packet type used the old way.
+struct LegacyPacket {
+  APSEthernetHeader header;
+  vector<uint32_t> payload;
+
+  LegacyPacket(const APSEthernetPacket & packet) : header(packet.header), payload(packet.payload.begin(), packet.payload.end()) {}
+
+  LegacyPacket(const vector<uint8_t> & packetData) {
+    auto bytes2uint16 = [&packetData](size_t offset) -> uint16_t {return (packetData[offset] << 8) + packetData[offset+1];};
+    auto bytes2uint32 = [&packetData](size_t offset) -> uint32_t {return (packetData[offset] << 24) + (packetData[offset+1] << 16) + (packetData[offset+2] << 8) + packetData[offset+3] ;};
+
+    std::copy(packetData.begin(), packetData.begin()+6, header.dest.addr.begin());
+    std::copy(packetData.begin()+6, packetData.begin()+12, header.src.addr.begin());
+    header.frameType = bytes2uint16(12);
+    header.seqNum = bytes2uint16(14);
+    header.command.packed = bytes2uint32(16);
+
+    size_t myOffset;
+    if (!header.command.ack && needs_address(APS_COMMANDS(header.command.cmd))){
+      header.addr = bytes2uint32(20);
+      myOffset = 24;
+    }
+    else{
+      myOffset = 20;
+    }
+    payload.clear();
+    payload.reserve((packetData.size() - myOffset)/4);
+    while(myOffset < packetData.size()){
+      payload.push_back(bytes2uint32(myOffset));
+      myOffset += 4;
+    }
+  }
+
+  size_t numBytes() const {
+    size_t trueSize = needs_address(APS_COMMANDS(header.command.cmd)) ? APSEthernetPacket::NUM_HEADER_BYTES + 4*payload.size() : APSEthernetPacket::NUM_HEADER_BYTES - 4 + 4*payload.size();
+    return std::max(trueSize, static_cast<size_t>(64));
+  }
+
+  vector<uint8_t> serialize() const {
+    vector<uint8_t> outVec;
+    outVec.resize(numBytes(), 0);
+
+    auto insertPt = outVec.begin();
+    std::copy(header.dest.addr.begin(), header.dest.addr.end(), insertPt); insertPt += 6;
+    std::copy(header.src.addr.begin(), header.src.addr.end(), insertPt); insertPt += 6;
+
+    uint16_t myuint16;
+    uint8_t * start = reinterpret_cast<uint8_t*>(&myuint16);
+    myuint16 = htons(header.frameType);
+    std::copy(start, start+2, insertPt); insertPt += 2;
+    myuint16 = htons(header.seqNum);
+    std::copy(start, start+2, insertPt); insertPt += 2;
+
+    uint32_t myuint32;
+    start = reinterpret_cast<uint8_t*>(&myuint32);
+    myuint32 = htonl(header.command.packed);
+    std::copy(start, start+4, insertPt); insertPt += 4;
+    if (needs_address(APS_COMMANDS(header.command.cmd))){
+      myuint32 = htonl(header.addr);
+      std::copy(start, start+4, insertPt); insertPt += 4;
+    }
+    for (auto word : payload){
+      myuint32 = htonl(word);
+      std::copy(start, start+4, insertPt); insertPt += 4;
+    }
+    return outVec;
+  }
+};
+
+APSEthernetPacket make_write_packet(size_t numWords) {
+  APSEthernetPacket packet;
+  packet.header.command.cmd = static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+  packet.header.command.cnt = numWords;
+  packet.header.addr = WFA_OFFSET;
+  for (size_t ct = 0; ct < numWords; ct++) {
+    packet.payload.push_back(ct);
+  }
+  return packet;
+}
+
+struct BenchResult {
+  double rate;
+  double allocationsPerPacket;
+};
+
+template <typename F>
+BenchResult run_bench(size_t numPackets, F handleOne) {
+  size_t startAllocations = allocationCount;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t ct = 0; ct < numPackets; ct++) {
+    handleOne(ct);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return {numPackets / std::chrono::duration<double>(end - start).count(),
+          static_cast<double>(allocationCount - startAllocations) / numPackets};
+}
+
+void report(const string & name, const BenchResult & result) {
+  cout << concol::RED << std::setw(32) << std::left << name << concol::RESET << std::fixed << std::setprecision(0)
+       << std::setw(10) << std::right << result.rate << " packets/s  "
+       << std::setprecision(2) << result.allocationsPerPacket << " allocations/packet" << endl;
+}
+
+int main (int argc, char* argv[])
+{
+
+  concol::concolinit();
+  cout << concol::RED << "BBN AP2 Transport Benchmark" << concol::RESET << endl;
+
+  size_t numPackets = 1000000;
+  string numPacketsOption = getCmdOption(argv, argv + argc, "--packets");
+  if (!numPacketsOption.empty()) {
+    numPackets = atol(numPacketsOption.c_str());
+  }
+
+  const vector<APSEthernetPacket> packets(20, make_write_packet(256));
+  const vector<LegacyPacket> legacyPackets(packets.begin(), packets.end());
+  uint32_t checksum = 0;
+
+  // send path before: copy each vector-payload packet then serialize into a freshly allocated vector
+  auto sendVector = run_bench(numPackets, [&](size_t ct){
+    LegacyPacket packet = legacyPackets[ct % legacyPackets.size()];
+    vector<uint8_t> wireData = packet.serialize();
+    checksum += wireData[ct % wireData.size()];
+  });
+  report("serialize() vector payload", sendVector);
+
+  // send path after: serialize in place into a reusable wire buffer
+  WireBuffer buffer;
+  auto sendBuffer = run_bench(numPackets, [&](size_t ct){
+    size_t numBytes = packets[ct % packets.size()].serialize(buffer.data);
+    checksum += buffer.data[ct % numBytes];
+  });
+  report("serialize() to wire buffer", sendBuffer);
+
+  // receive path before: copy the datagram into a vector, build a vector-payload packet from it, push a copy onto
+  // the device's std::queue and pop it back off into the reader's packet
+  const vector<uint8_t> datagram = packets[0].serialize();
+  std::queue<LegacyPacket> legacyQueue;
+  LegacyPacket legacyReceived(packets[0]);
+  auto receiveVector = run_bench(numPackets, [&](size_t ct){
+    vector<uint8_t> packetData(datagram.begin(), datagram.end());
+    LegacyPacket packet(packetData);
+    legacyQueue.emplace(packet);
+    legacyReceived = legacyQueue.front();
+    legacyQueue.pop();
+    checksum += legacyReceived.payload[ct % legacyReceived.payload.size()];
+  });
+  report("parse via vector and std::queue", receiveVector);
+
+  // receive path after: parse straight into a recycled queue slot and pop it into caller storage
+  SPSCQueue<APSEthernetPacket> queue(DEVICE_QUEUE_DEPTH);
+  APSEthernetPacket received;
+  auto receivePool = run_bench(numPackets, [&](size_t ct){
+    APSEthernetPacket * slot = queue.claim();
+    slot->deserialize(datagram.data(), datagram.size());
+    queue.publish();
+    received = queue.front();
+    queue.pop();
+    checksum += received.payload[ct % received.payload.size()];
+  });
+  report("parse into queue slot", receivePool);
+
+  cout << "Send speedup: " << std::setprecision(2) << sendBuffer.rate / sendVector.rate << "x, receive speedup: "
+       << receivePool.rate / receiveVector.rate << "x (checksum " << checksum << ")" << endl;
+
+  return 0;
+}
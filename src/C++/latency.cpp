@@ -0,0 +1,127 @@
+#include <iostream>
+
+#include "headings.h"
+#include "libaps.h"
+#include "constants.h"
+
+#include <concol.h>
+
+using namespace std;
+
+// Round trip latency of single register reads and writes, with and without the driver's low-latency mode
+
+// command options functions taken from:
+// http://stackoverflow.com/questions/865668/parse-command-line-arguments
+string getCmdOption(char ** begin, char ** end, const std::string & option)
+{
+  char ** itr = std::find(begin, end, option);
+  if (itr != end && ++itr != end)
+  {
+    return string(*itr);
+  }
+  return "";
+}
+
+// histogram bucket upper edges in microseconds; anything slower goes in the last bucket
+static const double bucketEdges[] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+static const size_t numBuckets = sizeof(bucketEdges)/sizeof(bucketEdges[0]) + 1;
+
+template <typename F>
+vector<double> time_calls(size_t numCalls, F call) {
+  vector<double> latencies(numCalls);
+  for (auto & latency : latencies) {
+    auto start = std::chrono::steady_clock::now();
+    call();
+    latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  }
+  return latencies;
+}
+
+void report(const string & name, vector<double> latencies) {
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p){ return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+
+  cout << concol::RED << name << concol::RESET << std::fixed << std::setprecision(1)
+       << ": p50 " << percentile(0.5) << " us, p90 " << percentile(0.9) << " us, p99 " << percentile(0.99)
+       << " us, p99.9 " << percentile(0.999) << " us, max " << latencies.back() << " us" << endl;
+
+  vector<size_t> counts(numBuckets, 0);
+  for (double latency : latencies) {
+    counts[std::upper_bound(bucketEdges, bucketEdges + numBuckets - 1, latency) - bucketEdges]++;
+  }
+  size_t maxCount = *std::max_element(counts.begin(), counts.end());
+  for (size_t ct = 0; ct < numBuckets; ct++) {
+    std::ostringstream label;
+    if (ct < numBuckets - 1) {
+      label << "< " << bucketEdges[ct] << " us";
+    } else {
+      label << ">= " << bucketEdges[ct-1] << " us";
+    }
+    cout << "  " << std::setw(12) << std::left << label.str() << std::setw(8) << std::right << counts[ct] << " "
+         << string(maxCount ? 50 * counts[ct] / maxCount : 0, '#') << endl;
+  }
+}
+
+int main (int argc, char* argv[])
+{
+
+  concol::concolinit();
+  cout << concol::RED << "BBN AP2 Latency Benchmark" << concol::RESET << endl;
+
+  set_logging_level(2);
+  init_nolog();
+
+  string deviceSerial = getCmdOption(argv, argv + argc, "--device");
+  if (deviceSerial.empty()) {
+    int numDevices = get_numDevices();
+    if (numDevices < 1) {
+      cout << concol::RED << "No APS2 found" << concol::RESET << endl;
+      return -1;
+    }
+    const char ** serialBuffer = new const char*[numDevices];
+    get_deviceSerials(serialBuffer);
+    deviceSerial = serialBuffer[0];
+    delete[] serialBuffer;
+  }
+
+  size_t numCalls = 10000;
+  string numCallsOption = getCmdOption(argv, argv + argc, "--calls");
+  if (!numCallsOption.empty()) {
+    numCalls = atol(numCallsOption.c_str());
+  }
+
+  int receiveCore = -1;
+  string coreOption = getCmdOption(argv, argv + argc, "--core");
+  if (!coreOption.empty()) {
+    receiveCore = atoi(coreOption.c_str());
+  }
+
+  int busyPollUS = 0;
+  string busyPollOption = getCmdOption(argv, argv + argc, "--busy-poll");
+  if (!busyPollOption.empty()) {
+    busyPollUS = atoi(busyPollOption.c_str());
+  }
+
+  connect_APS(deviceSerial.c_str());
+  cout << "Timing " << numCalls << " calls of each kind against " << deviceSerial << endl;
+
+  // writes put back the first word of waveform memory so nothing on the device changes
+  uint32_t waveformWord;
+  read_memory(deviceSerial.c_str(), MEMORY_ADDR + WFA_OFFSET, &waveformWord, 1);
+
+  for (int lowLatency = 0; lowLatency < 2; lowLatency++) {
+    set_low_latency(lowLatency, lowLatency ? receiveCore : -1, lowLatency ? busyPollUS : 0);
+    string mode = lowLatency ? "low-latency" : "default";
+
+    // warm up caches and the round trip estimate
+    time_calls(100, [&](){ read_register(deviceSerial.c_str(), PLL_STATUS_ADDR); });
+
+    report(mode + " register read", time_calls(numCalls, [&](){ read_register(deviceSerial.c_str(), PLL_STATUS_ADDR); }));
+    report(mode + " memory write", time_calls(numCalls, [&](){ write_memory(deviceSerial.c_str(), MEMORY_ADDR + WFA_OFFSET, &waveformWord, 1); }));
+  }
+  set_low_latency(0, -1, 0);
+
+  disconnect_APS(deviceSerial.c_str());
+
+  return 0;
+}
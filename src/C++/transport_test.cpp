@@ -0,0 +1,175 @@
+#include <iostream>
+
+#include "headings.h"
+#include "libaps.h"
+#include "constants.h"
+
+#include <concol.h>
+
+using namespace std;
+
+// End to end check of a transport backend against a stand-in APS2; see test/veth_test.sh. Uploads a block of
+// waveform memory, reads it back in bulk, word by word and as registers, and exits non-zero on any mismatch.
+
+// command options functions taken from:
+// http://stackoverflow.com/questions/865668/parse-command-line-arguments
+string getCmdOption(char ** begin, char ** end, const std::string & option)
+{
+  char ** itr = std::find(begin, end, option);
+  if (itr != end && ++itr != end)
+  {
+    return string(*itr);
+  }
+  return "";
+}
+
+static int numFailures = 0;
+
+void check(const string & name, bool passed) {
+  cout << concol::RED << std::setw(40) << std::left << name << concol::RESET << (passed ? "passed" : "FAILED") << endl;
+  if (!passed) {
+    numFailures++;
+  }
+}
+
+//Completions of the asynchronous operations, in the order their callbacks ran
+static struct {
+  std::mutex lock;
+  std::condition_variable finished;
+  vector<intptr_t> order;
+  bool allOK = true;
+} asyncResults;
+
+void async_done(const char *, int result, void * userData) {
+  std::lock_guard<std::mutex> guard(asyncResults.lock);
+  asyncResults.order.push_back(reinterpret_cast<intptr_t>(userData));
+  asyncResults.allOK &= (result == 0);
+  asyncResults.finished.notify_all();
+}
+
+int main (int argc, char* argv[])
+{
+
+  concol::concolinit();
+  cout << concol::RED << "BBN AP2 Transport Test" << concol::RESET << endl;
+
+  string deviceIP = getCmdOption(argv, argv + argc, "--device");
+  if (deviceIP.empty()) {
+    deviceIP = "10.0.0.2";
+  }
+  size_t numWords = 1 << 18;
+  string numWordsOption = getCmdOption(argv, argv + argc, "--words");
+  if (!numWordsOption.empty()) {
+    numWords = atol(numWordsOption.c_str());
+  }
+  string logLevel = getCmdOption(argv, argv + argc, "--log");
+  set_logging_level(logLevel.empty() ? logINFO : atoi(logLevel.c_str()));
+
+  // the packet ring is best chosen before enumerating so the replies already come through it
+  string transport = getCmdOption(argv, argv + argc, "--transport");
+  string interface = getCmdOption(argv, argv + argc, "--interface");
+  if (transport == "2") {
+    check("packet ring transport", set_packet_transport(interface.c_str()) == 0);
+  } else if (!transport.empty()) {
+    check("transport " + transport, set_transport(atoi(transport.c_str())) == 0);
+  }
+  cout << "Transport backend " << get_transport() << endl;
+
+  init_nolog();
+  const char * serials[64];
+  get_deviceSerials(serials);
+  bool found = false;
+  for (int ct = 0; ct < get_numDevices(); ct++) {
+    found |= (deviceIP == serials[ct]);
+  }
+  check("enumerate finds " + deviceIP, found);
+  if (!found) {
+    return 1;
+  }
+  connect_APS(deviceIP.c_str());
+
+  vector<uint32_t> data(numWords);
+  for (size_t ct = 0; ct < numWords; ct++) {
+    data[ct] = ct * 2654435761u;
+  }
+  const uint32_t addr = MEMORY_ADDR + WFA_OFFSET;
+
+  auto start = std::chrono::steady_clock::now();
+  int result = write_memory(deviceIP.c_str(), addr, data.data(), numWords);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  check("bulk upload", result == 0);
+  cout << std::fixed << std::setprecision(2) << numWords * 4 / 1e6 / seconds << " MB/s upload" << endl;
+
+  vector<uint32_t> readBack(numWords);
+  check("bulk read", read_memory(deviceIP.c_str(), addr, readBack.data(), numWords) == 0 && readBack == data);
+
+  bool singlesMatch = true;
+  for (size_t ct = 0; ct < 100; ct++) {
+    uint32_t word = 0;
+    read_memory(deviceIP.c_str(), addr + 4*ct, &word, 1);
+    singlesMatch &= (word == data[ct]);
+  }
+  check("single word reads", singlesMatch);
+
+  vector<uint32_t> addrs(100), values(100);
+  for (size_t ct = 0; ct < addrs.size(); ct++) {
+    addrs[ct] = addr + 4*(ct * 37 % numWords);
+  }
+  read_registers(deviceIP.c_str(), addrs.data(), values.data(), addrs.size());
+  bool registersMatch = true;
+  for (size_t ct = 0; ct < addrs.size(); ct++) {
+    registersMatch &= (values[ct] == data[ct * 37 % numWords]);
+  }
+  check("register reads", registersMatch);
+
+  // single acknowledged writes are control traffic and must not disturb an upload running alongside them
+  const uint32_t controlAddr = MEMORY_ADDR + WFB_OFFSET;
+  std::atomic<bool> uploading(true);
+  bool controlOK = true;
+  size_t numControlWrites = 0;
+  std::thread controlThread([&](){
+    for (uint32_t ct = 0; uploading || ct < 10; ct++) {
+      controlOK &= (write_memory(deviceIP.c_str(), controlAddr + 4*(ct % 64), &ct, 1) == 0);
+      uint32_t word = ~ct;
+      read_memory(deviceIP.c_str(), controlAddr + 4*(ct % 64), &word, 1);
+      controlOK &= (word == ct);
+      numControlWrites++;
+    }
+  });
+  std::reverse(data.begin(), data.end());
+  bool uploadOK = write_memory(deviceIP.c_str(), addr, data.data(), numWords) == 0;
+  uploading = false;
+  controlThread.join();
+  uploadOK &= read_memory(deviceIP.c_str(), addr, readBack.data(), numWords) == 0 && readBack == data;
+  check("upload alongside control writes", uploadOK);
+  check("control writes alongside upload", controlOK);
+  cout << numControlWrites << " control writes during the upload" << endl;
+
+  // asynchronous operations on one APS2 complete in the order they were started, whether they hold a worker or not
+  const intptr_t numStatusReads = 50;
+  vector<uint32_t> statusRegs(numStatusReads * APS_STATUS_REGISTERS);
+  uint32_t spiValue = ~0u;
+  std::reverse(data.begin(), data.end());
+  write_memory_async(deviceIP.c_str(), addr, data.data(), numWords, async_done, reinterpret_cast<void *>(0));
+  for (intptr_t ct = 0; ct < numStatusReads; ct++) {
+    read_status_registers_async(deviceIP.c_str(), &statusRegs[ct * APS_STATUS_REGISTERS], async_done, reinterpret_cast<void *>(ct + 1));
+  }
+  read_SPI_async(deviceIP.c_str(), 3, 0, &spiValue, async_done, reinterpret_cast<void *>(numStatusReads + 1));
+  std::fill(readBack.begin(), readBack.end(), 0);
+  read_memory_async(deviceIP.c_str(), addr, readBack.data(), numWords, async_done, reinterpret_cast<void *>(numStatusReads + 2));
+  bool asyncDone;
+  {
+    std::unique_lock<std::mutex> guard(asyncResults.lock);
+    asyncDone = asyncResults.finished.wait_for(guard, std::chrono::seconds(30), [&](){ return asyncResults.order.size() == size_t(numStatusReads + 3); });
+  }
+  bool inOrder = asyncDone;
+  for (size_t ct = 0; inOrder && ct < asyncResults.order.size(); ct++) {
+    inOrder = (asyncResults.order[ct] == intptr_t(ct));
+  }
+  check("asynchronous operations", asyncDone && asyncResults.allOK && readBack == data && spiValue == 0);
+  check("asynchronous operations in order", inOrder);
+
+  disconnect_APS(deviceIP.c_str());
+  cout << (numFailures ? "FAILED" : "All passed") << endl;
+  return numFailures ? 1 : 0;
+}
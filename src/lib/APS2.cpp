@@ -1,21 +1,28 @@
 #include "APS2.h"
 
-APS2::APS2() :  isOpen{false}, channels_(2), samplingRate_{-1} {};
+APS2::APS2() :  isOpen{false}, handle_{INVALID_DEVICE_HANDLE}, channels_(2), samplingRate_{-1} {};
 
-APS2::APS2(string deviceSerial) :  isOpen{false}, deviceSerial_{deviceSerial}, samplingRate_{-1} {
+APS2::APS2(string deviceSerial) :  isOpen{false}, deviceSerial_{deviceSerial}, handle_{INVALID_DEVICE_HANDLE}, samplingRate_{-1} {
 	channels_.reserve(2);
 	for(size_t ct=0; ct<2; ct++) channels_.push_back(Channel(ct));
 };
 
-APS2::~APS2() = default;
+APS2::~APS2() {
+	pendingJobs_.wait();
+}
 
-APSEthernet::EthernetError APS2::connect(){
+APSEthernet::EthernetError APS2::connect(const bool & probePayload /* see header for default = false */){
 	if (!isOpen) {
-		APSEthernet::EthernetError success = APSEthernet::get_instance().connect(deviceSerial_);
+		DeviceHandle handle = APSEthernet::get_instance().connect(deviceSerial_);
+		APSEthernet::EthernetError success = handle == INVALID_DEVICE_HANDLE ? APSEthernet::INVALID_APS_ID : APSEthernet::SUCCESS;
 
 		if (success == APSEthernet::SUCCESS) {
+			handle_ = handle;
 			FILE_LOG(logINFO) << "Opened connection to device: " << deviceSerial_;
 			isOpen = true;
+			if (probePayload) {
+				probe_max_payload();
+			}
 		}
 		// TODO: restore state information from file
 		return success;
@@ -25,7 +32,7 @@ APSEthernet::EthernetError APS2::connect(){
 
 APSEthernet::EthernetError APS2::disconnect(){
 	if (isOpen){
-		APSEthernet::EthernetError success = APSEthernet::get_instance().disconnect(deviceSerial_);
+		APSEthernet::EthernetError success = APSEthernet::get_instance().disconnect(handle_);
 		if (success == APSEthernet::SUCCESS) {
 			FILE_LOG(logINFO) << "Closed connection to device: " << deviceSerial_;
 			isOpen = false;
@@ -36,6 +43,15 @@ APSEthernet::EthernetError APS2::disconnect(){
 	return APSEthernet::SUCCESS;
 }
 
+DeviceHandle APS2::handle() {
+	//Talking to the device implies we want to hear from it, e.g. after a re-enumerate dropped the connection
+	APSEthernet & socket = APSEthernet::get_instance();
+	if (handle_ == INVALID_DEVICE_HANDLE || !socket.is_connected(handle_)) {
+		handle_ = socket.get_handle(deviceSerial_);
+	}
+	return handle_;
+}
+
 int APS2::reset(const APS_RESET_MODE_STAT & resetMode /* default SOFT_RESET */) {
 	
 	APSCommand_t command = { .packed=0 };
@@ -108,12 +124,19 @@ int APS2::setup_DACs() {
 }
 
 APSStatusBank_t APS2::read_status_registers(){
+	return parse_status(query(status_request()));
+}
+
+APSEthernetPacket APS2::status_request(){
 	//Query with the status request command
 	APSCommand_t command = { .packed=0 };
 	command.cmd = static_cast<uint32_t>(APS_COMMANDS::STATUS);
 	command.r_w = 1;
 	command.mode_stat = APS_STATUS_HOST;
-	APSEthernetPacket statusPacket = query(command)[0];
+	return APSEthernetPacket(command, 0);
+}
+
+APSStatusBank_t APS2::parse_status(const APSEthernetPacket & statusPacket){
 	//Copy the data back into the status type 
 	APSStatusBank_t statusRegs;
 	std::copy(statusPacket.payload.begin(), statusPacket.payload.end(), statusRegs.array);
@@ -121,6 +144,30 @@ APSStatusBank_t APS2::read_status_registers(){
 	return statusRegs;
 }
 
+namespace {
+//A callback for the query_async operations that fulfils promise
+template <typename R>
+std::function<void(std::exception_ptr, R)> fulfil(std::shared_ptr<std::promise<R>> promise) {
+	return [promise](std::exception_ptr error, R result){
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value(result);
+		}
+	};
+}
+}
+
+std::future<APSStatusBank_t> APS2::read_status_registers_async(){
+	auto promise = std::make_shared<std::promise<APSStatusBank_t>>();
+	read_status_registers_async(fulfil(promise));
+	return promise->get_future();
+}
+
+void APS2::read_status_registers_async(std::function<void(std::exception_ptr, APSStatusBank_t)> callback){
+	query_async<APSStatusBank_t>({status_request()}, parse_status, callback);
+}
+
 double APS2::get_uptime(){
 	/*
 	* Return the board uptime in seconds.
@@ -167,8 +214,8 @@ int APS2::store_image(const string & bitFile, const int & position) { /* see hea
 	uint32_t addr = 0; // todo: make start address depend on position
 	auto packets = pack_data(addr, packedData, APS_COMMANDS::FPGACONFIG_ACK);
 
-	// send in groups of 20
-	APSEthernet::get_instance().send(deviceSerial_, packets, 20);
+	// send in acknowledged groups; see set_ack_every
+	APSEthernet::get_instance().send(handle(), std::move(packets), APSEthernet::get_instance().get_ack_every(handle()));
 	return 0;
 }
 
@@ -183,7 +230,7 @@ int APS2::select_image(const int & bitFileNum) {
 	packet.header.command.cnt = 0;
 	packet.header.addr = addr;
 
-	return APSEthernet::get_instance().send(deviceSerial_, packet, false);
+	return APSEthernet::get_instance().send(handle(), packet, false);
 }
 
 int APS2::program_FPGA(const string & bitFile) {
@@ -443,30 +490,233 @@ int APS2::write_memory(const uint32_t & addr, const vector<uint32_t> & data){
 	vector<APSEthernetPacket> dataPackets = pack_data(addr, data);
 
 	//Send the packets out 
-	APSEthernet::get_instance().send(deviceSerial_, dataPackets, 20);
+	APSEthernet::get_instance().send(handle(), std::move(dataPackets), APSEthernet::get_instance().get_ack_every(handle()));
 
 	return 0;
 }
 
 vector<uint32_t> APS2::read_memory(const uint32_t & addr, const uint32_t & numWords){
-	//TODO: handle numWords that require mulitple packets
+	APSCommand_t command = { .packed=0 };
+	command.r_w = 1;
+	command.cmd =  static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+	return read_pipelined(command, addr, numWords, APSEthernet::get_instance().get_max_payload(handle()));
+}
+
+vector<uint32_t> APS2::read_registers(const vector<uint32_t> & addrs){
+	/*
+	 * Read a set of single registers, e.g. PLL status, phase counters and cache status.
+	 * All the requests go out before we wait on any replies so the round trips overlap.
+	 */
+	APSEthernet & socket = APSEthernet::get_instance();
+	vector<uint32_t> values(addrs.size());
+	vector<APSEthernetPacket> requests(std::min(addrs.size(), MAX_OUTSTANDING_REQUESTS));
+
+	for (size_t first = 0; first < addrs.size(); first += requests.size()) {
+		size_t numRequests = std::min(addrs.size() - first, requests.size());
+		for (size_t ct = 0; ct < numRequests; ct++) {
+			APSEthernetPacket & readReq = requests[ct];
+			readReq.header.command.r_w = 1;
+			readReq.header.command.cmd =  static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+			readReq.header.command.cnt = 1;
+			readReq.header.addr = addrs[first + ct];
+			socket.send_request(handle(), readReq);
+		}
+		//Collect every reply even after a failure so no request is left outstanding
+		bool timedOut = false;
+		APSEthernetPacket reply;
+		for (size_t ct = 0; ct < numRequests; ct++) {
+			if (socket.receive_reply(handle(), requests[ct], reply) != APSEthernet::SUCCESS) {
+				timedOut = true;
+			} else if (!reply.payload.empty()) {
+				values[first + ct] = reply.payload[0];
+			}
+		}
+		if (timedOut) {
+			throw runtime_error("Timed out on receive");
+		}
+	}
+	return values;
+}
 
-	//Send the read request
-	APSEthernetPacket readReq;
-	readReq.header.command.r_w = 1;
-	readReq.header.command.cmd =  static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
-	readReq.header.command.cnt = numWords;
-	readReq.header.addr = addr;
-	APSEthernet::get_instance().send(deviceSerial_, readReq, false);
+std::future<int> APS2::write_memory_async(const uint32_t & addr, const vector<uint32_t> & data){
+	return run_async([this, addr, data](){ return write_memory(addr, data); });
+}
 
-	//Retrieve the data packet(s)
-	auto readData = read_packets(1);
+std::future<vector<uint32_t>> APS2::read_memory_async(const uint32_t & addr, const uint32_t & numWords){
+	return run_async([this, addr, numWords](){ return read_memory(addr, numWords); });
+}
 
-	return readData[0].payload;
+int APS2::probe_max_payload(){
+	/*
+	 * Find the largest payload that makes the round trip reliably and use it for bulk transfers. Each candidate
+	 * size reads a block of waveform memory and writes it straight back, so both directions are exercised without
+	 * changing anything. A size passes if every trial is answered first time. Sizes that don't fit the path MTU
+	 * aren't tried, and a size that fails is never tried again: the probe moves straight on to the next one down.
+	 */
+	static const size_t candidates[] = {APSEthernetPacket::MAX_PAYLOAD_WORDS, 362, 320, 288, DEFAULT_MAX_PAYLOAD};
+	static const int numTrials = 8;
+	static const size_t probeTimeoutMS = 200;
+	APSEthernet & socket = APSEthernet::get_instance();
+	size_t pathLimit = socket.get_path_max_payload(handle());
+
+	for (size_t numWords : candidates) {
+		if (numWords > pathLimit && numWords > DEFAULT_MAX_PAYLOAD) {
+			FILE_LOG(logDEBUG) << "Payloads of " << numWords << " words don't fit the path MTU to " << deviceSerial_;
+			continue;
+		}
+		uint64_t startRetransmits = socket.get_retransmit_count(handle());
+		bool reliable = true, answered = true;
+		for (int ct = 0; reliable && ct < numTrials; ct++) {
+			APSEthernetPacket readReq, writeReq, reply;
+			readReq.header.command.r_w = 1;
+			readReq.header.command.cmd = static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+			readReq.header.command.cnt = numWords;
+			readReq.header.addr = MEMORY_ADDR + WFA_OFFSET;
+			answered = (socket.query(handle(), readReq, reply, probeTimeoutMS) == APSEthernet::SUCCESS);
+			reliable = answered && (reply.payload.size() >= numWords);
+			if (!reliable) break;
+
+			writeReq.header.command.cmd = static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK);
+			writeReq.header.command.cnt = numWords;
+			writeReq.header.addr = MEMORY_ADDR + WFA_OFFSET;
+			//A padded reply can carry more than we asked for; write back exactly what CNT says
+			writeReq.payload.assign(reply.payload.begin(), reply.payload.begin() + numWords);
+			answered = reliable = (socket.query(handle(), writeReq, reply, probeTimeoutMS) == APSEthernet::SUCCESS);
+		}
+		if (reliable && socket.get_retransmit_count(handle()) == startRetransmits) {
+			FILE_LOG(logINFO) << "Using " << numWords << " word payloads for " << deviceSerial_;
+			socket.set_max_payload(handle(), numWords);
+			return numWords;
+		}
+		if (!answered) {
+			//Frames too big for the link vanish rather than failing, so no answer means the size isn't supported
+			FILE_LOG(logDEBUG) << "No answer to " << numWords << " word payloads from " << deviceSerial_ << "; treating the size as unsupported";
+		} else {
+			FILE_LOG(logDEBUG) << "Payloads of " << numWords << " words are not reliable for " << deviceSerial_;
+		}
+	}
+	FILE_LOG(logWARNING) << "No payload size probed reliably for " << deviceSerial_ << "; keeping " << socket.get_max_payload(handle()) << " words";
+	return socket.get_max_payload(handle());
+}
+
+int APS2::calibrate_transport(){
+	/*
+	 * Find the payload size, chunk length and acknowledge window that upload fastest to this device over this network
+	 * path. One setting is swept at a time with the others held at the best found so far. Each trial writes a fresh
+	 * test pattern over a scratch block of waveform memory and reads it back; a setting that loses data, fails or
+	 * needs more than the odd retransmission is ruled out. The block's original contents are put back afterwards and
+	 * the winning settings are kept for the device's MAC address.
+	 */
+	static const size_t payloads[] = {DEFAULT_MAX_PAYLOAD, 288, 320, 362, APSEthernetPacket::MAX_PAYLOAD_WORDS};
+	static const unsigned chunkLengths[] = {5, 10, DEFAULT_ACK_EVERY, 40, 80};
+	static const unsigned windows[] = {2, 4, DEFAULT_ACK_WINDOW, 16, 32};
+	static const uint32_t numWords = 1 << 16;
+	static const int numTrials = 3;
+	// retransmissions per packet beyond which a setting is too lossy to use
+	static const double maxRetransmitRate = 0.01;
+	const uint32_t scratchAddr = MEMORY_ADDR + WFA_OFFSET;
+	APSEthernet & socket = APSEthernet::get_instance();
+
+	TransportProfile original = {socket.get_max_payload(handle()), socket.get_ack_every(handle()), socket.get_ack_window(handle())};
+	auto use_profile = [&](const TransportProfile & profile){
+		socket.set_max_payload(handle(), profile.maxPayload);
+		socket.set_ack_every(handle(), profile.ackEvery);
+		socket.set_ack_window(handle(), profile.ackWindow);
+	};
+
+	//Upload rate in MB/s, or zero if the setting isn't reliable
+	uint32_t patternSeed = 1;
+	auto measure = [&](const TransportProfile & profile){
+		use_profile(profile);
+		double seconds = 0;
+		try {
+			for (int trial = 0; trial < numTrials; trial++) {
+				//A new pattern every time so a packet that never arrived can't pass for one that did
+				vector<uint32_t> pattern(numWords);
+				for (auto & word : pattern) {
+					word = (patternSeed++) * 2654435761u;
+				}
+				vector<APSEthernetPacket> packets = pack_data(scratchAddr, pattern);
+				size_t numPackets = packets.size();
+				uint64_t startRetransmits = socket.get_retransmit_count(handle());
+				auto start = std::chrono::steady_clock::now();
+				if (socket.send(handle(), std::move(packets), profile.ackEvery) != APSEthernet::SUCCESS) {
+					return 0.0;
+				}
+				seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				double retransmitRate = static_cast<double>(socket.get_retransmit_count(handle()) - startRetransmits) / numPackets;
+				if (retransmitRate > maxRetransmitRate || read_memory(scratchAddr, numWords) != pattern) {
+					FILE_LOG(logDEBUG) << "Ruling out " << profile.maxPayload << " word payloads in chunks of " << profile.ackEvery
+						<< " with a window of " << profile.ackWindow << " for " << deviceSerial_;
+					return 0.0;
+				}
+			}
+		} catch (std::exception & e) {
+			FILE_LOG(logDEBUG) << "Calibration trial failed: " << e.what();
+			return 0.0;
+		}
+		double rate = 4.0 * numWords * numTrials / seconds / 1e6;
+		FILE_LOG(logDEBUG) << profile.maxPayload << " word payloads in chunks of " << profile.ackEvery << " with a window of "
+			<< profile.ackWindow << " upload at " << rate << " MB/s";
+		return rate;
+	};
+
+	//Writing the block straight back warms up the round trip estimate before anything is timed
+	vector<uint32_t> saved = read_memory(scratchAddr, numWords);
+	write_memory(scratchAddr, saved);
+
+	TransportProfile best = original;
+	double bestRate = measure(best);
+	auto try_profile = [&](const TransportProfile & candidate){
+		double rate = measure(candidate);
+		if (rate > bestRate) {
+			best = candidate;
+			bestRate = rate;
+		}
+	};
+	for (size_t payload : payloads) {
+		if (payload != best.maxPayload) {
+			TransportProfile candidate = best;
+			candidate.maxPayload = payload;
+			try_profile(candidate);
+		}
+	}
+	for (unsigned ackEvery : chunkLengths) {
+		if (ackEvery != best.ackEvery) {
+			TransportProfile candidate = best;
+			candidate.ackEvery = ackEvery;
+			try_profile(candidate);
+		}
+	}
+	for (unsigned window : windows) {
+		if (window != best.ackWindow) {
+			TransportProfile candidate = best;
+			candidate.ackWindow = window;
+			try_profile(candidate);
+		}
+	}
+
+	if (bestRate == 0) {
+		use_profile(original);
+		write_memory(scratchAddr, saved);
+		FILE_LOG(logWARNING) << "No transport setting uploaded reliably to " << deviceSerial_ << "; keeping the current ones";
+		return -1;
+	}
+	socket.set_transport_profile(handle(), best);
+	write_memory(scratchAddr, saved);
+	FILE_LOG(logINFO) << "Using " << best.maxPayload << " word payloads in chunks of " << best.ackEvery << " with a window of "
+		<< best.ackWindow << " for " << deviceSerial_ << " (" << bestRate << " MB/s)";
+	return 0;
 }
 
 //SPI read/write
 int APS2::write_SPI(vector<uint32_t> & msg) {
+	query(SPI_write_request(msg));
+	// TODO: check ACK packet status
+	return 0;
+}
+
+APSEthernetPacket APS2::SPI_write_request(vector<uint32_t> & msg) {
 	// push on "end of message"
 	APSChipConfigCommand_t cmd = {.packed=0};
 	cmd.target = CHIPCONFIG_IO_TARGET_EOL;
@@ -478,14 +728,21 @@ int APS2::write_SPI(vector<uint32_t> & msg) {
 	packet.header.command.cmd =  static_cast<uint32_t>(APS_COMMANDS::CHIPCONFIGIO);
 	packet.header.command.cnt = msg.size();
 	packet.payload = msg;
-
-	APSEthernetPacket p = query(packet)[0];
-	// TODO: check ACK packet status
-	return 0;
+	return packet;
 }
 
 uint32_t APS2::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & addr) {
 	// reads a single 32-bit word from the target SPI device
+	vector<APSEthernetPacket> requests = SPI_read_requests(target, addr);
+	if (requests.empty()) {
+		return 0;
+	}
+	// write the SPI read instruction and then read back the result
+	query(requests[0]);
+	return parse_SPI_read(query(requests[1]));
+}
+
+vector<APSEthernetPacket> APS2::SPI_read_requests(const CHIPCONFIG_IO_TARGET & target, const uint16_t & addr) {
 
 	// build message
 	APSChipConfigCommand_t cmd;
@@ -516,7 +773,7 @@ uint32_t APS2::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & ad
 			break;
 		default:
 			FILE_LOG(logERROR) << "Invalid read_SPI target " << myhex << target;
-			return 0;
+			return vector<APSEthernetPacket>();
 	}
 	cmd.spicnt_data = 1; // request 1 byte
 	vector<uint32_t> msg = {cmd.packed};
@@ -525,16 +782,19 @@ uint32_t APS2::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & ad
 	msg.push_back(cmd.packed);
 	msg.push_back(cmd.packed);
 
-	// write the SPI read instruction
-	write_SPI(msg);
+	// the SPI read instruction
+	vector<APSEthernetPacket> requests = {SPI_write_request(msg)};
 
 	// build read packet
 	APSEthernetPacket packet;
 	packet.header.command.r_w = 1;
 	packet.header.command.cmd = static_cast<uint32_t>(APS_COMMANDS::CHIPCONFIGIO);
 	packet.header.command.cnt = 1; // single word read
+	requests.push_back(packet);
+	return requests;
+}
 
-	APSEthernetPacket response = query(packet)[0];
+uint32_t APS2::parse_SPI_read(const APSEthernetPacket & response) {
 	// TODO: Check status bits
 	if (response.payload.size() == 0) {
 		return 0;
@@ -544,6 +804,21 @@ uint32_t APS2::read_SPI(const CHIPCONFIG_IO_TARGET & target, const uint16_t & ad
 	}
 }
 
+std::future<uint32_t> APS2::read_SPI_async(const CHIPCONFIG_IO_TARGET & target, const uint16_t & addr){
+	auto promise = std::make_shared<std::promise<uint32_t>>();
+	read_SPI_async(target, addr, fulfil(promise));
+	return promise->get_future();
+}
+
+void APS2::read_SPI_async(const CHIPCONFIG_IO_TARGET & target, const uint16_t & addr, std::function<void(std::exception_ptr, uint32_t)> callback){
+	vector<APSEthernetPacket> requests = SPI_read_requests(target, addr);
+	if (requests.empty()) {
+		callback(nullptr, 0);
+		return;
+	}
+	query_async<uint32_t>(requests, parse_SPI_read, callback);
+}
+
 //Flash read/write
 int APS2::write_flash(const uint32_t & addr, vector<uint32_t> & data) {
 	// erase before write
@@ -558,7 +833,7 @@ int APS2::write_flash(const uint32_t & addr, vector<uint32_t> & data) {
 
 	FILE_LOG(logDEBUG) << "Writing " << packets.size() << " packets of data to flash address " << myhex << addr;
 	try {
-		APSEthernet::get_instance().send(deviceSerial_, packets);
+		APSEthernet::get_instance().send(handle(), std::move(packets));
 		// APSEthernetPacket p = read_packets(packets.size())[0];
 		// return p.header.command.mode_stat;
 		return 0;
@@ -586,8 +861,7 @@ int APS2::erase_flash(uint32_t addr, uint32_t numBytes) {
 
 	while(erasedBytes < numBytes) {
 		FILE_LOG(logDEBUG) << "Erasing a 64 KB page at addr: " << myhex << addr;
-		write_command(command, addr, false);
-		APSEthernetPacket p = read_packets(1)[0];
+		APSEthernetPacket p = query(command, addr);
 		if (p.header.command.mode_stat == EPROM_OPERATION_FAILED){
 			FILE_LOG(logERROR) << "Flash memory erase command failed!";
 		}
@@ -598,20 +872,12 @@ int APS2::erase_flash(uint32_t addr, uint32_t numBytes) {
 }
 
 vector<uint32_t> APS2::read_flash(const uint32_t & addr, const uint32_t & numWords) {
-	//TODO: handle reads that require multiple packets
 	APSCommand_t command = { .packed=0 };
 	command.r_w = 1;
 	command.cmd = static_cast<uint32_t>(APS_COMMANDS::EPROMIO);
 	command.mode_stat = EPROM_RW;
-	command.cnt = std::min(numWords, static_cast<const uint32_t>(365));
-
-	vector<uint32_t> data;
-	// TODO: loop sending write and read commands, until received at least numWords
-	APSEthernetPacket p = query(command, addr)[0];
 	// TODO: Check status bits
-	data.insert(data.end(), p.payload.begin(), p.payload.end());
-
-	return data;
+	return read_pipelined(command, addr, numWords, std::min(APSEthernet::get_instance().get_max_payload(handle()), size_t(365)));
 }
 
 uint64_t APS2::get_mac_addr() {
@@ -674,23 +940,81 @@ int APS2::write_command(const APSCommand_t & command, const uint32_t & addr, con
 	*/
 	//TODO: figure out move constructor
 	APSEthernetPacket packet(command, addr);
-	APSEthernet::get_instance().send(deviceSerial_, packet, checkResponse);
+	APSEthernet::get_instance().send(handle(), packet, checkResponse);
 	return 0;
 }
 
+vector<uint32_t> APS2::read_pipelined(const APSCommand_t & command, const uint32_t & addr, const uint32_t & numWords, const uint32_t & maxPayload){
+	/*
+	 * Read numWords starting at byte address addr. Long reads are split into maxPayload sized requests and up to
+	 * MAX_OUTSTANDING_REQUESTS of them are kept in flight; each reply is copied into place by its request address.
+	 */
+	APSEthernet & socket = APSEthernet::get_instance();
+	const size_t numRequests = (numWords + maxPayload - 1) / maxPayload;
+	vector<uint32_t> data(numWords);
+	vector<APSEthernetPacket> requests(std::min(std::max(numRequests, size_t(1)), MAX_OUTSTANDING_REQUESTS));
+
+	auto send_next = [&](size_t reqCt){
+		APSEthernetPacket & readReq = requests[reqCt % requests.size()];
+		uint32_t offset = reqCt * maxPayload;
+		readReq.header.command = command;
+		readReq.header.command.cnt = std::min(maxPayload, numWords - offset);
+		readReq.header.addr = addr + 4*offset;
+		socket.send_request(handle(), readReq);
+	};
+
+	//Prime the pipeline then send a new request each time the oldest one is answered
+	size_t numSent = 0;
+	for (; numSent < requests.size() && numSent < numRequests; numSent++) {
+		send_next(numSent);
+	}
+	//Collect every reply even after a failure so no request is left outstanding
+	bool failed = false;
+	APSEthernetPacket reply;
+	for (size_t reqCt = 0; reqCt < numSent; reqCt++) {
+		const APSEthernetPacket & readReq = requests[reqCt % requests.size()];
+		if (socket.receive_reply(handle(), readReq, reply) != APSEthernet::SUCCESS) {
+			failed = true;
+		} else if (reply.payload.size() < readReq.header.command.cnt) {
+			FILE_LOG(logERROR) << "Read of " << readReq.header.command.cnt << " words at " << hexn<8> << readReq.header.addr
+			                   << std::dec << " returned " << reply.payload.size() << " words";
+			failed = true;
+		} else {
+			//Short replies may come padded out to the minimum frame size so only take the words asked for
+			std::copy(reply.payload.begin(), reply.payload.begin() + readReq.header.command.cnt, data.begin() + (readReq.header.addr - addr)/4);
+		}
+		if (!failed && numSent < numRequests) {
+			send_next(numSent++);
+		}
+	}
+	if (failed) {
+		throw runtime_error("Timed out on receive");
+	}
+
+	return data;
+}
+
 vector<APSEthernetPacket> APS2::pack_data(const uint32_t & addr, const vector<uint32_t> & data, const APS_COMMANDS & cmdtype /* see header for default */) {
 	//Break the data up into ethernet frame sized chunks.   
 	// ethernet frame payload = 1500bytes - 20bytes IPV4 and 8 bytes UDP and 24 bytes APS header (with address field) = 1448bytes = 362 words
-	// for unknown reasons, we see occasional failures when using packets that large. 256 seems to be more stable.
-	static const int maxPayload = 256;
+	// for unknown reasons, we see occasional failures when using packets that large so the default is 256;
+	// see set_max_payload/probe_max_payload for links (e.g. with jumbo frames) that do better
+	int maxPayload = APSEthernet::get_instance().get_max_payload(handle());
+	if (cmdtype == APS_COMMANDS::EPROMIO) {
+		// flash is programmed in 256 byte pages so keep packets page aligned
+		maxPayload = std::max(maxPayload - maxPayload % 64, 64);
+	} else if (cmdtype == APS_COMMANDS::FPGACONFIG_ACK) {
+		// bitfile payloads must be a multiple of 8 bytes
+		maxPayload = std::max(maxPayload - maxPayload % 2, 2);
+	}
 
 	vector<APSEthernetPacket> packets;
+	packets.reserve((data.size() + maxPayload - 1) / maxPayload);
 
 	APSEthernetPacket newPacket;
 	newPacket.header.command.cmd =  static_cast<uint32_t>(cmdtype);
 	
 	auto idx = data.begin();
-	uint16_t seqNum = 0;
 	uint32_t curAddr = addr;
 	while (idx != data.end()){
 		if (std::distance(idx, data.end()) > maxPayload){
@@ -700,12 +1024,10 @@ vector<APSEthernetPacket> APS2::pack_data(const uint32_t & addr, const vector<ui
 			newPacket.header.command.cnt = std::distance(idx, data.end());
 		}
 		
-		newPacket.header.seqNum = seqNum++;
 		newPacket.header.addr = curAddr; 
 		curAddr += 4*newPacket.header.command.cnt;
 		
-		newPacket.payload.clear();
-		std::copy(idx, idx+newPacket.header.command.cnt, std::back_inserter(newPacket.payload));
+		newPacket.payload.assign(idx, idx+newPacket.header.command.cnt);
 
 		packets.push_back(newPacket);
 		idx += newPacket.header.command.cnt;
@@ -715,20 +1037,80 @@ vector<APSEthernetPacket> APS2::pack_data(const uint32_t & addr, const vector<ui
 }
 
 
-vector<APSEthernetPacket> APS2::read_packets(const size_t & numPackets) {
-	return APSEthernet::get_instance().receive(deviceSerial_, numPackets);
+APSEthernetPacket APS2::query(const APSCommand_t & command, const uint32_t & addr /* see header for default value = 0 */) {
+	return query(APSEthernetPacket(command, addr));
 }
 
-vector<APSEthernetPacket> APS2::query(const APSCommand_t & command, const uint32_t & addr /* see header for default value = 0 */) {
-	//write-read ping-pong
-	write_command(command, addr, false);
-	return read_packets(1);
+APSEthernetPacket APS2::query(const APSEthernetPacket & pkt) {
+	//write-read ping-pong; the reply is matched to this request so stale packets can't be taken for it
+	APSEthernetPacket response;
+	if (APSEthernet::get_instance().query(handle(), pkt, response) != APSEthernet::SUCCESS) {
+		throw runtime_error("Timed out on receive");
+	}
+	return response;
+}
+
+namespace {
+//A query_async operation on its way through its requests
+template <typename R>
+struct QueryChain {
+	DeviceHandle device;
+	vector<APSEthernetPacket> requests;
+	std::function<R(const APSEthernetPacket &)> parse;
+	std::function<void(std::exception_ptr, R)> callback;
+	//Lets the device's next job start
+	std::function<void()> done;
+	//Last, so an abandoned chain counts out of the APS2's pending jobs before the callback, which may hold the APS2, goes
+	std::shared_ptr<void> ticket;
+};
+
+template <typename R>
+void finish_query(std::shared_ptr<QueryChain<R>> chain, std::exception_ptr error, R result) {
+	try {
+		chain->callback(error, result);
+	} catch (std::exception & e) {
+		FILE_LOG(logERROR) << "Asynchronous query callback failed: " << e.what();
+	}
+	chain->ticket.reset();
+	chain->done();
+}
+
+//Send request ct, and once it is answered the next one or, after the last, the result
+template <typename R>
+void send_query(std::shared_ptr<QueryChain<R>> chain, size_t ct) {
+	try {
+		APSEthernet::get_instance().async_query(chain->device, chain->requests[ct], [chain, ct](APSEthernet::EthernetError status, const APSEthernetPacket & reply){
+			if (status != APSEthernet::SUCCESS) {
+				finish_query(chain, std::make_exception_ptr(runtime_error("Timed out on receive")), R());
+			} else if (ct + 1 < chain->requests.size()) {
+				send_query(chain, ct + 1);
+			} else {
+				try {
+					R result = chain->parse(reply);
+					finish_query(chain, nullptr, result);
+				} catch (...) {
+					finish_query(chain, std::current_exception(), R());
+				}
+			}
+		});
+	} catch (...) {
+		finish_query(chain, std::current_exception(), R());
+	}
+}
 }
 
-vector<APSEthernetPacket> APS2::query(const APSEthernetPacket & pkt) {
-	//write-read ping-pong
-	APSEthernet::get_instance().send(deviceSerial_, pkt, false);
-	return read_packets(1);
+template <typename R>
+void APS2::query_async(const vector<APSEthernetPacket> & requests, std::function<R(const APSEthernetPacket &)> parse, std::function<void(std::exception_ptr, R)> callback) {
+	auto chain = std::make_shared<QueryChain<R>>();
+	chain->device = handle();
+	chain->requests = requests;
+	chain->parse = parse;
+	chain->callback = callback;
+	chain->ticket = pendingJobs_.ticket();
+	APSEthernet::get_instance().post_async(chain->device, [chain](std::function<void()> done){
+		chain->done = done;
+		send_query(chain, 0);
+	});
 }
 
 vector<uint32_t> APS2::build_DAC_SPI_msg(const CHIPCONFIG_IO_TARGET & target, const vector<SPI_AddrData_t> & addrData) {
@@ -1163,10 +1545,7 @@ int APS2::run_chip_config(const uint32_t & addr /* default = 0 */) {
 	packet.header.command.cmd =  static_cast<uint32_t>(APS_COMMANDS::RUNCHIPCONFIG);
 	packet.header.command.cnt = 0;
 	packet.header.addr = addr;
-	APSEthernet::get_instance().send(deviceSerial_, packet, false);
-
-	//Retrieve the data packet(s)
-	auto response = read_packets(1)[0];
+	auto response = query(packet);
 	if (response.header.command.mode_stat == RUNCHIPCONFIG_SUCCESS) {
 		FILE_LOG(logDEBUG1) << "Chip config successful";
 	}
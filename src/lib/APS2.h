@@ -22,7 +22,7 @@ public:
 	APS2(string);
 	~APS2();
 
-	APSEthernet::EthernetError connect();
+	APSEthernet::EthernetError connect(const bool & probePayload = false);
 	APSEthernet::EthernetError disconnect();
 
 	int init(const bool & = false, const int & bitFileNum = 0);
@@ -83,6 +83,9 @@ public:
 	//Whether the APS connection is open
 	bool isOpen;
 
+	//The device's handle in the transport; looked up once and then reused by every call
+	DeviceHandle handle();
+
 	bool running;
 
 	//Pretty printers
@@ -93,11 +96,34 @@ public:
 	int write_memory(const uint32_t & addr, const vector<uint32_t> & data);
 	int write_memory(const uint32_t & addr, const uint32_t & data);
 	vector<uint32_t> read_memory(const uint32_t &, const uint32_t &);
+	vector<uint32_t> read_registers(const vector<uint32_t> &);
+
+	//Find the largest bulk transfer payload the link carries reliably
+	int probe_max_payload();
+	//Find the payload size, chunk length and window that upload fastest, and keep them for this device's MAC address
+	int calibrate_transport();
 
 	//SPI read/write
 	int write_SPI(vector<uint32_t> &);
 	uint32_t read_SPI(const CHIPCONFIG_IO_TARGET &, const uint16_t &);
 
+	//Asynchronous variants. These return straight away and run on the driver's I/O workers; operations on one
+	//device run in the order they were started. Any exception is rethrown from the future's get(). Destroying
+	//the APS2 waits for the operations it started; don't assign to one while they are running.
+	std::future<int> write_memory_async(const uint32_t & addr, const vector<uint32_t> & data);
+	std::future<vector<uint32_t>> read_memory_async(const uint32_t &, const uint32_t &);
+	//The SPI and status reads are only queries, so they don't hold a worker while waiting on the device
+	std::future<uint32_t> read_SPI_async(const CHIPCONFIG_IO_TARGET &, const uint16_t &);
+	std::future<APSStatusBank_t> read_status_registers_async();
+	//The same with a callback in place of the future. It runs on a driver worker with the failure, if any, and the result.
+	void read_SPI_async(const CHIPCONFIG_IO_TARGET &, const uint16_t &, std::function<void(std::exception_ptr, uint32_t)>);
+	void read_status_registers_async(std::function<void(std::exception_ptr, APSStatusBank_t)>);
+
+	template <typename T>
+	std::future<int> set_waveform_async(const int & dac, const vector<T> & data){
+		return run_async([this, dac, data](){ return set_waveform(dac, data); });
+	}
+
 	//Flash read/write
 	int write_flash(const uint32_t &, vector<uint32_t> &);
 	vector<uint32_t> read_flash(const uint32_t &, const uint32_t &);
@@ -117,20 +143,83 @@ public:
 private:
 
 	string deviceSerial_;
+	DeviceHandle handle_;
 	vector<Channel> channels_;
+
+	//Run func as one of the device's asynchronous jobs and hand back its result through a future
+	template <typename F>
+	auto run_async(F func) -> std::future<decltype(func())> {
+		auto promise = std::make_shared<std::promise<decltype(func())>>();
+		auto result = promise->get_future();
+		auto ticket = pendingJobs_.ticket();
+		APSEthernet::get_instance().post(handle(), [promise, func, ticket](){
+			try {
+				promise->set_value(func());
+			} catch (...) {
+				promise->set_exception(std::current_exception());
+			}
+		});
+		return result;
+	}
+
+	//Asynchronous jobs refer back to this object so the destructor waits for them. A copy has none of its own.
+	struct PendingJobs {
+		PendingJobs() {};
+		PendingJobs(const PendingJobs &) {};
+		PendingJobs & operator=(const PendingJobs &) { return *this; };
+
+		//A job holds a ticket for as long as it exists. It counts out when the last copy goes, so a job the driver
+		//drops unrun at shutdown doesn't leave the destructor waiting.
+		std::shared_ptr<void> ticket() {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				count++;
+			}
+			return std::shared_ptr<void>(nullptr, [this](void *){ finish(); });
+		};
+		void finish() {
+			std::lock_guard<std::mutex> guard(lock);
+			if (--count == 0) {
+				finished.notify_all();
+			}
+		};
+		void wait() {
+			std::unique_lock<std::mutex> guard(lock);
+			finished.wait(guard, [this](){ return count == 0; });
+		};
+
+		std::mutex lock;
+		std::condition_variable finished;
+		size_t count = 0;
+	};
+	PendingJobs pendingJobs_;
+
 	int samplingRate_;
 	MACAddr macAddr_;
 
 	//Read/Write commands 
 	int write_command(const APSCommand_t &, const uint32_t & addr = 0, const bool & checkResponse = true);
 	vector<APSEthernetPacket> pack_data(const uint32_t &, const vector<uint32_t> &, const APS_COMMANDS & cmdtype = APS_COMMANDS::USERIO_ACK);
-	vector<APSEthernetPacket> read_packets(const size_t &);
+	vector<uint32_t> read_pipelined(const APSCommand_t &, const uint32_t &, const uint32_t &, const uint32_t &);
 
 	int erase_flash(uint32_t, uint32_t);
 
 	//Single packet query
-	vector<APSEthernetPacket> query(const APSCommand_t &, const uint32_t & addr = 0);
-	vector<APSEthernetPacket> query(const APSEthernetPacket &);
+	APSEthernetPacket query(const APSCommand_t &, const uint32_t & addr = 0);
+	APSEthernetPacket query(const APSEthernetPacket &);
+
+	//Send requests one after another as each is answered, without a worker waiting on any of them, and hand parse's
+	//reading of the last reply to callback. Takes its turn among the device's asynchronous jobs.
+	template <typename R>
+	void query_async(const vector<APSEthernetPacket> &, std::function<R(const APSEthernetPacket &)>, std::function<void(std::exception_ptr, R)>);
+
+	//The packets behind read_status_registers and read_SPI, and how to read their replies. The SPI read is a write
+	//asking the chip for the byte and a read fetching it; there are no packets for an unknown target.
+	static APSEthernetPacket status_request();
+	static APSStatusBank_t parse_status(const APSEthernetPacket &);
+	static vector<APSEthernetPacket> SPI_read_requests(const CHIPCONFIG_IO_TARGET &, const uint16_t &);
+	static uint32_t parse_SPI_read(const APSEthernetPacket &);
+	static APSEthernetPacket SPI_write_request(vector<uint32_t> &);
 
 	vector<uint32_t> build_DAC_SPI_msg(const CHIPCONFIG_IO_TARGET &, const vector<SPI_AddrData_t> &);
 	vector<uint32_t> build_PLL_SPI_msg(const vector<SPI_AddrData_t> &);
@@ -1,69 +1,453 @@
 #include "APSEthernet.h"
 
-APSEthernet::APSEthernet() : socket_(ios_) {
+#include <numeric>
+
+#ifdef HAVE_SENDMMSG
+#include <sys/socket.h>
+#include <poll.h>
+#include <cerrno>
+#include <linux/sock_diag.h>
+#endif
+
+#ifdef HAVE_DEVICE_SOCKETS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef HAVE_PACKET_MMAP
+#include <linux/filter.h>
+#endif
+
+#ifdef HAVE_INTERFACE_SOCKETS
+#include <ifaddrs.h>
+#include <net/if.h>
+#endif
+
+namespace {
+//Pin a thread to one core; a no-op where that isn't supported
+bool pin_thread(std::thread & thread, unsigned core) {
+#ifdef HAVE_DEVICE_SOCKETS
+    core %= std::max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(core, &cpuSet);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet), &cpuSet) == 0;
+#else
+    return false;
+#endif
+}
+
+//One turn of a spin loop. Yielding costs little when there is a core to spare and stops the spinner starving the
+//thread it is waiting on when there isn't.
+inline void spin_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+    std::this_thread::yield();
+}
+
+//Have the kernel report with each datagram how many it has dropped on the socket so far
+void enable_drop_counts(udp::socket & socket) {
+#ifdef SO_RXQ_OVFL
+    int enable = 1;
+    if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) != 0) {
+        FILE_LOG(logWARNING) << "Unable to enable kernel drop counts: " << strerror(errno);
+    }
+#endif
+}
+
+//The kernel's running count of datagrams dropped on a socket, which is what SO_RXQ_OVFL reports with each datagram.
+//async_receive_from has nowhere to put that, so the asio backend asks for the count when it is wanted instead.
+bool read_socket_drops(udp::socket & socket, uint32_t & drops) {
+#if defined(HAVE_SENDMMSG) && defined(SO_MEMINFO)
+    uint32_t meminfo[SK_MEMINFO_VARS] = {0};
+    socklen_t length = sizeof(meminfo);
+    if (getsockopt(socket.native_handle(), SOL_SOCKET, SO_MEMINFO, meminfo, &length) == 0 && length > SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+        drops = meminfo[SK_MEMINFO_DROPS];
+        return true;
+    }
+#endif
+    return false;
+}
+
+//Have the kernel throw away everything arriving on a socket, or stop doing so. Used while the packet ring delivers the
+//same datagrams so they aren't read twice.
+void drop_datagrams(udp::socket & socket, bool drop) {
+#ifdef HAVE_PACKET_MMAP
+    if (drop) {
+        sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+        sock_fprog filter = {1, code};
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter));
+    } else {
+        int unused = 0;
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+    }
+#endif
+}
+
+struct HostInterface {
+    string name;
+    asio::ip::address_v4 address;
+    asio::ip::address_v4 netmask;
+};
+
+//Interfaces that are up, aren't loopback and have an IPv4 address, optionally only those named
+vector<HostInterface> host_interfaces(const vector<string> & names) {
+    vector<HostInterface> found;
+#ifdef HAVE_INTERFACE_SOCKETS
+    ifaddrs * addrs;
+    if (getifaddrs(&addrs) != 0) {
+        FILE_LOG(logERROR) << "Unable to list network interfaces: " << strerror(errno);
+        return found;
+    }
+    for (ifaddrs * ifa = addrs; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET || !ifa->ifa_netmask ||
+            !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK)) {
+            continue;
+        }
+        if (!names.empty() && std::find(names.begin(), names.end(), string(ifa->ifa_name)) == names.end()) {
+            continue;
+        }
+        HostInterface hostInterface;
+        hostInterface.name = ifa->ifa_name;
+        hostInterface.address = asio::ip::address_v4(ntohl(reinterpret_cast<const sockaddr_in *>(ifa->ifa_addr)->sin_addr.s_addr));
+        hostInterface.netmask = asio::ip::address_v4(ntohl(reinterpret_cast<const sockaddr_in *>(ifa->ifa_netmask)->sin_addr.s_addr));
+        found.push_back(hostInterface);
+    }
+    freeifaddrs(addrs);
+#endif
+    return found;
+}
+
+//Send and receive only through one interface, even when another has a route to the same subnet. Kernels before 5.7
+//want CAP_NET_RAW for this; without it the socket's bound address still picks the interface in all but that case.
+void bind_to_interface(udp::socket & socket, const string & name) {
+#if defined(HAVE_INTERFACE_SOCKETS) && defined(SO_BINDTODEVICE)
+    if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_BINDTODEVICE, name.c_str(), name.size()) != 0) {
+        FILE_LOG(logDEBUG1) << "Unable to bind a socket to interface " << name << ": " << strerror(errno);
+    }
+#endif
+}
+}
+
+APSEthernet::APSEthernet() : numDeviceQueues_{0}, socket_(ios_), sharedDrops_{0}, receiveBufferBytes_{0}, sendBufferBytes_{0}, deviceSockets_{false}, dedicatedThreads_{false}, firstCore_{-1}, numInterfaces_{0}, multiInterface_{false}, ringRunning_{false}, lowLatency_{false}, busyPollUS_{0} {
+#ifdef HAVE_SENDMMSG
+    backend_ = MMSG_TRANSPORT;
+#else
+    backend_ = ASIO_TRANSPORT;
+#endif
+
     //Setup the socket to the APS_PROTO port and enable broadcasting for enumerating
     std::error_code ec;
     socket_.open(udp::v4(), ec);
     if (ec) {FILE_LOG(logERROR) << "Failed to open socket.";}
+#ifdef HAVE_DEVICE_SOCKETS
+    //Device sockets share the port
+    socket_.set_option(udp::socket::reuse_address(true));
+#endif
     socket_.bind(udp::endpoint(udp::v4(), APS_PROTO), ec);
     if (ec) {FILE_LOG(logERROR) << "Failed to bind to socket.";}
 
     socket_.set_option(asio::socket_base::broadcast(true));
+    enable_drop_counts(socket_);
 
     //io_service will return immediately so post receive task before .run()
-    setup_receive();
+    setup_receive(socket_, receivedData_, senderEndpoint_, sharedDrops_, nullptr);
 
     //Setup the asio service to run on a background thread
-    receiveThread_ = std::thread([&](){ ios_.run(); });
+    receiveThread_ = std::thread([&](){ receive_loop(ios_); });
+
+    //Start the workers for asynchronous operations; the work object keeps them alive while idle
+    work_.reset(new asio::io_service::work(workIos_));
+    for (size_t ct = 0; ct < NUM_ASYNC_WORKERS; ct++) {
+        workerThreads_.emplace_back([&](){ workIos_.run(); });
+    }
 
 };
 
 APSEthernet::~APSEthernet() {
-    //Stop the receive thread
+    //Stop the workers first as their jobs may be waiting on the receive thread
+    work_.reset();
+    workIos_.stop();
+    for (auto & worker : workerThreads_) {
+        worker.join();
+    }
+
+    close_ring();
+
+    //Stop the device I/O threads and then the receive thread
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+    for (size_t ct = 0; ct < numQueues; ct++) {
+        DeviceSocket * deviceSocket = deviceQueues_[ct]->socket.get();
+        if (deviceSocket && deviceSocket->ios) {
+            deviceSocket->ios->stop();
+            deviceSocket->thread.join();
+        }
+    }
     ios_.stop();
     receiveThread_.join();
+
+    //Sockets on the shared io_service have to go before it does, as do the timers of asynchronous queries on workIos_
+    for (size_t ct = 0; ct < numQueues; ct++) {
+        deviceQueues_[ct]->socket.reset();
+        for (auto & request : deviceQueues_[ct]->pending) {
+            request.async.reset();
+        }
+        deviceQueues_[ct]->waitingQueries.clear();
+    }
+    for (size_t ct = 0; ct < numInterfaces_; ct++) {
+        interfaces_[ct].reset();
+    }
+}
+
+void APSEthernet::receive_loop(asio::io_service & ios){
+    //Normally sleep until a socket is readable; in low-latency mode keep checking without ever blocking. Serves the
+    //shared receive thread and the dedicated device threads alike.
+    while (!ios.stopped()) {
+        if (lowLatency_) {
+            if (ios.poll() == 0) {
+                spin_pause();
+            }
+        } else {
+            ios.run_one();
+        }
+    }
 }
 
-void APSEthernet::setup_receive(){
-    socket_.async_receive_from(
-        asio::buffer(receivedData_, 2048), senderEndpoint_,
-        [this](std::error_code ec, std::size_t bytesReceived)
+void APSEthernet::setup_receive(udp::socket & socket, uint8_t (*buffers)[2048], udp::endpoint & senderEndpoint, std::atomic<uint32_t> & kernelDrops, DeviceQueue * queue){
+    //Datagrams on a device socket can only have come from that device; those on the shared socket are sorted by sender
+#ifdef HAVE_SENDMMSG
+    if (backend_ == MMSG_TRANSPORT) {
+        //Wait for the socket to become readable and then drain everything queued in one go
+        socket.async_receive(asio::null_buffers(),
+            [this, &socket, buffers, &senderEndpoint, &kernelDrops, queue](std::error_code ec, std::size_t)
+            {
+                if (!ec) {
+                    receive_batch(socket, buffers, kernelDrops, queue);
+                }
+                setup_receive(socket, buffers, senderEndpoint, kernelDrops, queue);
+        });
+        return;
+    }
+#endif
+    socket.async_receive_from(
+        asio::buffer(buffers[0], 2048), senderEndpoint,
+        [this, &socket, buffers, &senderEndpoint, &kernelDrops, queue](std::error_code ec, std::size_t bytesReceived)
         {
             //If there is anything to look at hand it off to the sorter
             if (!ec && bytesReceived > 0)
             {
-                vector<uint8_t> packetData(receivedData_, receivedData_ + bytesReceived);
-                sort_packet(packetData, senderEndpoint_);
+                dispatch_packet(queue, buffers[0], bytesReceived, senderEndpoint);
             }
 
             //Start the receiver again
-            setup_receive();
+            setup_receive(socket, buffers, senderEndpoint, kernelDrops, queue);
     });
 }
 
-void APSEthernet::sort_packet(const vector<uint8_t> & packetData, const udp::endpoint & sender){
-    //If we have the endpoint address then add it to the queue
-    string senderIP = sender.address().to_string();
-    if(msgQueues_.find(senderIP) == msgQueues_.end()){
+void APSEthernet::receive_batch(udp::socket & socket, uint8_t (*buffers)[2048], std::atomic<uint32_t> & kernelDrops, DeviceQueue * queue){
+#ifdef HAVE_SENDMMSG
+    mmsghdr msgs[MAX_RECV_BATCH];
+    iovec iovecs[MAX_RECV_BATCH];
+    sockaddr_storage senders[MAX_RECV_BATCH];
+    //Room for the SO_RXQ_OVFL drop count that comes with each datagram
+    alignas(cmsghdr) uint8_t controls[MAX_RECV_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+
+    int numReceived;
+    do {
+        std::memset(msgs, 0, sizeof(msgs));
+        for (size_t ct = 0; ct < MAX_RECV_BATCH; ct++) {
+            iovecs[ct].iov_base = buffers[ct];
+            iovecs[ct].iov_len = 2048;
+            msgs[ct].msg_hdr.msg_iov = &iovecs[ct];
+            msgs[ct].msg_hdr.msg_iovlen = 1;
+            msgs[ct].msg_hdr.msg_name = &senders[ct];
+            msgs[ct].msg_hdr.msg_namelen = sizeof(senders[ct]);
+            msgs[ct].msg_hdr.msg_control = controls[ct];
+            msgs[ct].msg_hdr.msg_controllen = sizeof(controls[ct]);
+        }
+        numReceived = recvmmsg(socket.native_handle(), msgs, MAX_RECV_BATCH, MSG_DONTWAIT, nullptr);
+        for (int ct = 0; ct < numReceived; ct++) {
+#ifdef SO_RXQ_OVFL
+            //The count is a running total for the socket so the latest one is all we need
+            for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msgs[ct].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[ct].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                    uint32_t drops;
+                    std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                    if (drops != kernelDrops.load(std::memory_order_relaxed)) {
+                        kernelDrops = drops;
+                    }
+                }
+            }
+#endif
+            udp::endpoint sender;
+            std::memcpy(sender.data(), &senders[ct], msgs[ct].msg_hdr.msg_namelen);
+            sender.resize(msgs[ct].msg_hdr.msg_namelen);
+            dispatch_packet(queue, buffers[ct], msgs[ct].msg_len, sender);
+        }
+    } while (numReceived == static_cast<int>(MAX_RECV_BATCH));
+#endif
+}
+
+void APSEthernet::dispatch_packet(DeviceQueue * queue, const uint8_t * packetData, size_t length, const udp::endpoint & sender){
+    //The packet ring sees the same datagrams and is the only producer while it is in use
+    if (backend_ == PACKET_MMAP_TRANSPORT) {
+        return;
+    }
+    if (!queue) {
+        sort_packet(packetData, length, sender);
+    } else if (queue->connected) {
+        queue_packet(queue, packetData, length);
+    } else {
+        //The device was disconnected but its socket still gets its datagrams, e.g. enumerate status replies.
+        //Only the receive thread may touch the device info so hand a copy over.
+        vector<uint8_t> packetCopy(packetData, packetData + length);
+        ios_.post([this, packetCopy, sender](){ sort_packet(packetCopy.data(), packetCopy.size(), sender); });
+    }
+}
+
+void APSEthernet::sort_packet(const uint8_t * packetData, size_t length, const udp::endpoint & sender){
+    //If the sender is a connected device hand the packet to its queue
+    //Slots were resolved at connect() so this is a short scan with no lock or string lookup
+    //Devices with their own socket are fed from it alone so their rings keep a single producer, unless the packet ring
+    //is feeding everything
+    DeviceQueue * queue = nullptr;
+    if (sender.address().is_v4()) {
+        uint32_t senderAddr = sender.address().to_v4().to_ulong();
+        bool fromRing = backend_ == PACKET_MMAP_TRANSPORT;
+        size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+        for (size_t ct = 0; ct < numQueues; ct++) {
+            if (deviceQueues_[ct]->ipAddr == senderAddr && deviceQueues_[ct]->connected && (fromRing || !deviceQueues_[ct]->socket)) {
+                queue = deviceQueues_[ct].get();
+                break;
+            }
+        }
+    }
+
+    if (!queue) {
         //If it isn't in our list of APSs then perhaps we are seeing an enumerate status response
         //If so add the device info to the set
-        if (packetData.size() == 84) {
-            devInfo_[senderIP].endpoint = sender;
+        if (length == 84) {
+            string senderIP = sender.address().to_string();
             //Turn the byte array into a packet to extract the MAC address
             //Not strictly necessary as we could just use the broadcast MAC address
-            APSEthernetPacket packet = APSEthernetPacket(packetData);
+            APSEthernetPacket packet = APSEthernetPacket(packetData, length);
+            std::lock_guard<std::mutex> guard(enumerateLock_);
+            devInfo_[senderIP].endpoint = sender;
             devInfo_[senderIP].macAddr = packet.header.src;
             FILE_LOG(logDEBUG1) << "Added device with IP " << senderIP << " and MAC addresss " << devInfo_[senderIP].macAddr.to_string();
+            deviceFound_.notify_all();
         } 
+        return;
+    }
+
+    queue_packet(queue, packetData, length);
+}
+
+void APSEthernet::queue_packet(DeviceQueue * queue, const uint8_t * packetData, size_t length){
+    queue->counters.add_received(length);
+    //Parse the byte array straight into the next recycled slot of the message queue
+    APSEthernetPacket * packet = queue->packets.claim();
+    bool queueFull = !packet;
+    if (queueFull) {
+        packet = &queue->overflowPacket;
+    }
+    packet->deserialize(packetData, length);
+
+    //Replies to outstanding queries skip the queue; the slot is simply reused for the next packet
+    if (queue->numPending.load(std::memory_order_acquire) > 0 && deliver_reply(queue, *packet)) {
+        return;
+    }
+    if (queueFull) {
+        FILE_LOG(logWARNING) << "Receive queue for " << asio::ip::address_v4(queue->ipAddr).to_string() << " is full; dropping packet";
+        return;
+    }
+    queue->packets.publish();
+    TransportCounters::raise(queue->counters.maxReceiveQueueDepth, queue->packets.size());
+    //Wake the reader if it is asleep. The fence orders the push before the check against the reader's
+    //store to waiting so one of us always sees the other.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queue->waiting) {
+        std::lock_guard<std::mutex> guard(queue->waitLock);
+        queue->packetArrived.notify_one();
+    }
+}
+
+namespace {
+//Acknowledges echo the command nibble and read/write bit so together with the sequence number they identify the request
+inline bool reply_matches(const PendingRequest & request, const APSEthernetPacket & packet) {
+    return request.active && !request.answered && request.seqNum == packet.header.seqNum &&
+        request.command == (packet.header.command.packed & 0x1F000000u);
+}
+}
+
+struct AsyncQuery {
+    AsyncQuery(asio::io_service & ios, DeviceQueue * queue, const APSEthernetPacket & request, APSEthernet::ReplyHandler handler) :
+        queue{queue}, request(request), handler(handler), timer(ios), retries{0}, finished{false} {};
+
+    DeviceQueue * queue;
+    APSEthernetPacket request;
+    APSEthernet::ReplyHandler handler;
+    //Expires when the request is due to be sent again
+    asio::steady_timer timer;
+    unsigned retries;
+    //Set under the device's pendingLock by whichever of the reply and the last timeout comes first
+    bool finished;
+};
+
+namespace {
+//An escaping exception would take down the worker thread with it
+void call_handler(const APSEthernet::ReplyHandler & handler, APSEthernet::EthernetError result, const APSEthernetPacket & reply) {
+    try {
+        handler(result, reply);
+    } catch (std::exception & e) {
+        FILE_LOG(logERROR) << "Asynchronous query handler failed: " << e.what();
+    }
+}
+}
+
+bool APSEthernet::deliver_reply(DeviceQueue * queue, const APSEthernetPacket & packet) {
+    std::lock_guard<std::mutex> guard(queue->pendingLock);
+    for (auto & request : queue->pending) {
+        if (reply_matches(request, packet)) {
+            request.reply = packet;
+            request.answered = true;
+            request.answeredAt = std::chrono::steady_clock::now();
+            if (request.async) {
+                //The slot is freed here and the rest is left to a worker so the receive thread can get on
+                std::shared_ptr<AsyncQuery> query = request.async;
+                query->finished = true;
+                bool sampleRTT = !request.retransmitted && query->request.header.command.cmd != static_cast<uint32_t>(APS_COMMANDS::EPROMIO);
+                auto roundTrip = std::chrono::duration_cast<std::chrono::microseconds>(request.answeredAt - request.sentAt);
+                release_request(queue, request);
+                workIos_.post([queue, query, packet, sampleRTT, roundTrip](){
+                    queue->timer.reset_backoff();
+                    if (sampleRTT) {
+                        queue->timer.add_sample(roundTrip);
+                        queue->counters.add_round_trip(roundTrip);
+                    }
+                    call_handler(query->handler, SUCCESS, packet);
+                });
+            }
+            queue->replyArrived.notify_all();
+            return true;
+        }
     }
-    else{
-        //Turn the byte array into an APSEthernetPacket
-        APSEthernetPacket packet = APSEthernetPacket(packetData);
-        //Grab a lock and push the packet into the message queue
-        mLock_.lock();
-        msgQueues_[senderIP].emplace(packet);
-        mLock_.unlock();
+    return false;
+}
+
+void APSEthernet::release_request(DeviceQueue * queue, PendingRequest & request) {
+    //Called with pendingLock held. A waiting asynchronous query takes the slot over straight away.
+    request.active = false;
+    request.async.reset();
+    queue->numPending--;
+    if (!queue->waitingQueries.empty()) {
+        std::shared_ptr<AsyncQuery> next = queue->waitingQueries.front();
+        queue->waitingQueries.pop_front();
+        queue->numPending++;
+        workIos_.post([this, next](){ issue_async(next); });
     }
+    queue->replyArrived.notify_all();
 }
 
 /* PUBLIC methods */
@@ -73,10 +457,13 @@ APSEthernet::EthernetError APSEthernet::init() {
     return SUCCESS;
 }
 
-set<string> APSEthernet::enumerate() {
+set<string> APSEthernet::enumerate(size_t expectedDevices, const vector<MACAddr> & expectedMACs, size_t timeoutMS) {
 	/*
-	 * Look for all APS units that respond to the broadcast packet
+	 * Look for all APS units that respond to the broadcast packet. The broadcast is repeated every
+	 * ENUMERATE_RETRY_MS, up to ENUMERATE_BROADCASTS times, so a single lost packet doesn't hide a device.
+	 * Without anything to wait for we have to listen until the deadline.
 	 */
+    typedef std::chrono::steady_clock clock;
 
 	FILE_LOG(logDEBUG1) << "APSEthernet::enumerate";
 
@@ -84,13 +471,58 @@ set<string> APSEthernet::enumerate() {
 
     //Put together the broadcast status request
     APSEthernetPacket broadcastPacket = APSEthernetPacket::create_broadcast_packet();
+    vector<uint8_t> broadcastData = broadcastPacket.serialize();
     udp::endpoint broadCastEndPoint(asio::ip::address_v4::broadcast(), APS_PROTO);
-    socket_.send_to(asio::buffer(broadcastPacket.serialize()), broadCastEndPoint);
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    auto all_found = [&](){
+        if (expectedDevices == 0 && expectedMACs.empty()) {
+            return false;
+        }
+        if (devInfo_.size() < expectedDevices) {
+            return false;
+        }
+        return std::all_of(expectedMACs.begin(), expectedMACs.end(), [&](const MACAddr & mac){
+            return std::any_of(devInfo_.begin(), devInfo_.end(), [&](const std::pair<const string, EthernetDevInfo> & kv){
+                return kv.second.macAddr == mac;
+            });
+        });
+    };
+
+    auto start = clock::now();
+    auto deadline = start + std::chrono::milliseconds(timeoutMS);
+    auto nextBroadcast = start;
+    unsigned numBroadcasts = 0;
+    std::unique_lock<std::mutex> lock(enumerateLock_);
+    while (!all_found()) {
+        auto now = clock::now();
+        if (now >= deadline) {
+            break;
+        }
+        if (numBroadcasts < ENUMERATE_BROADCASTS && now >= nextBroadcast) {
+            //Over several interfaces each gets its own subnet broadcast; the global one only leaves by the default route
+            if (multiInterface_) {
+                for (size_t ct = 0; ct < numInterfaces_; ct++) {
+                    InterfaceSocket * hostInterface = interfaces_[ct].get();
+                    std::error_code ec;
+                    if (hostInterface->active) {
+                        hostInterface->socket.send_to(asio::buffer(broadcastData), udp::endpoint(hostInterface->broadcast(), APS_PROTO), 0, ec);
+                    }
+                    if (ec) {
+                        FILE_LOG(logWARNING) << "Unable to broadcast on " << hostInterface->name << ": " << ec.message();
+                    }
+                }
+            } else {
+                socket_.send_to(asio::buffer(broadcastData), broadCastEndPoint);
+            }
+            numBroadcasts++;
+            nextBroadcast = now + std::chrono::milliseconds(ENUMERATE_RETRY_MS);
+        }
+        deviceFound_.wait_until(lock, numBroadcasts < ENUMERATE_BROADCASTS ? std::min(nextBroadcast, deadline) : deadline);
+    }
+    FILE_LOG(logDEBUG1) << "Enumerate finished after " << std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start).count() << " ms";
 
     set<string> deviceSerials;
-    for (auto kv : devInfo_) {
+    for (auto & kv : devInfo_) {
         FILE_LOG(logINFO) << "Found device: " << kv.first;
         deviceSerials.insert(kv.first);
     }
@@ -98,139 +530,1847 @@ set<string> APSEthernet::enumerate() {
 }
 
 void APSEthernet::reset_maps() {
-    devInfo_.clear();
-    msgQueues_.clear();
+    {
+        std::lock_guard<std::mutex> guard(enumerateLock_);
+        devInfo_.clear();
+    }
+    std::lock_guard<std::mutex> guard(mLock_);
+    for (auto & kv : handles_) {
+        deviceQueues_[kv.second]->connected = false;
+    }
+    handles_.clear();
 }
 
-APSEthernet::EthernetError APSEthernet::connect(string serial) {
+DeviceHandle APSEthernet::connect(string serial) {
+    std::lock_guard<std::mutex> guard(mLock_);
+    auto handleIter = handles_.find(serial);
+    if (handleIter != handles_.end()) {
+        return handleIter->second;
+    }
 
-    mLock_.lock();
-	msgQueues_[serial] = queue<APSEthernetPacket>();
-    mLock_.unlock();
-	return SUCCESS;
+    std::error_code ec;
+    auto addr = asio::ip::address_v4::from_string(serial, ec);
+    if (ec) {
+        FILE_LOG(logERROR) << "Invalid device IP address: " << serial;
+        return INVALID_DEVICE_HANDLE;
+    }
+
+    //Reuse the slot from an earlier connection to this address or claim a new one
+    DeviceQueue * queue = nullptr;
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_relaxed);
+    size_t slot;
+    for (slot = 0; slot < numQueues; slot++) {
+        if (deviceQueues_[slot]->ipAddr == addr.to_ulong()) {
+            queue = deviceQueues_[slot].get();
+            break;
+        }
+    }
+    if (!queue) {
+        if (numQueues == MAX_CONNECTED_DEVICES) {
+            FILE_LOG(logERROR) << "Cannot connect to more than " << MAX_CONNECTED_DEVICES << " devices";
+            return INVALID_DEVICE_HANDLE;
+        }
+        deviceQueues_[numQueues].reset(new DeviceQueue(numQueues, addr.to_ulong()));
+        queue = deviceQueues_[numQueues].get();
+        numDeviceQueues_.store(numQueues + 1, std::memory_order_release);
+    }
+
+    //Pick up the MAC address if the device answered the enumerate
+    queue->devInfo.endpoint = udp::endpoint(addr, APS_PROTO);
+    {
+        std::lock_guard<std::mutex> enumerateGuard(enumerateLock_);
+        auto devInfoIter = devInfo_.find(serial);
+        if (devInfoIter != devInfo_.end()) {
+            queue->devInfo.macAddr = devInfoIter->second.macAddr;
+        }
+        //Bring back the settings calibrated for this device
+        auto profileIter = profiles_.find(queue->devInfo.macAddr);
+        if (profileIter != profiles_.end()) {
+            apply_profile(queue, profileIter->second);
+        }
+        auto linkAddrIter = linkAddrs_.find(addr.to_ulong());
+        if (linkAddrIter != linkAddrs_.end()) {
+            queue->linkAddr = linkAddrIter->second;
+        }
+        queue->devInfo.hostInterface = multiInterface_ ? find_interface(addr.to_ulong()) : nullptr;
+        if (queue->devInfo.hostInterface) {
+            FILE_LOG(logDEBUG1) << "Reaching " << serial << " through interface " << queue->devInfo.hostInterface->name;
+        }
+    }
+
+    //Throw away anything left over from a previous connection. A reader may still be waiting on the ring from before a
+    //re-enumerate so take its lock to stay the only consumer.
+    {
+        std::lock_guard<std::mutex> readGuard(queue->readLock);
+        while (!queue->packets.empty()) {
+            queue->packets.pop();
+        }
+    }
+    if (deviceSockets_ && !queue->socket) {
+        open_device_socket(queue, slot, addr);
+    }
+    queue->connected = true;
+    handles_[serial] = slot;
+    return slot;
 }
 
-APSEthernet::EthernetError APSEthernet::disconnect(string serial) {
-    mLock_.lock();
-	msgQueues_.erase(serial);
-    mLock_.unlock();
+APSEthernet::EthernetError APSEthernet::disconnect(DeviceHandle handle) {
+    std::lock_guard<std::mutex> guard(mLock_);
+    if (handle >= 0 && static_cast<size_t>(handle) < numDeviceQueues_.load(std::memory_order_relaxed)) {
+        deviceQueues_[handle]->connected = false;
+        handles_.erase(deviceQueues_[handle]->serial);
+    }
 	return SUCCESS;
 }
 
-APSEthernet::EthernetError APSEthernet::send(string serial, APSEthernetPacket msg, bool checkResponse) {
-    msg.header.dest = devInfo_[serial].macAddr;
-    return send_chunk(serial, vector<APSEthernetPacket>(1, msg), !checkResponse);
+DeviceHandle APSEthernet::get_handle(string serial) {
+    DeviceHandle handle = connect(serial);
+    if (handle == INVALID_DEVICE_HANDLE) {
+        throw runtime_error("Unable to open receive queue for " + serial);
+    }
+    return handle;
+}
+
+DeviceHandle APSEthernet::find_handle(const string & serial) {
+    std::error_code ec;
+    auto addr = asio::ip::address_v4::from_string(serial, ec);
+    if (ec) {
+        return INVALID_DEVICE_HANDLE;
+    }
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+    for (size_t slot = 0; slot < numQueues; slot++) {
+        if (deviceQueues_[slot]->ipAddr == addr.to_ulong()) {
+            return slot;
+        }
+    }
+    return INVALID_DEVICE_HANDLE;
+}
+
+bool APSEthernet::is_connected(DeviceHandle handle) {
+    return get_queue(handle)->connected;
+}
+
+DeviceQueue * APSEthernet::get_queue(DeviceHandle handle) {
+    //Only looks the device up; connecting is left to the caller, see APS2::handle
+    if (handle < 0 || static_cast<size_t>(handle) >= numDeviceQueues_.load(std::memory_order_acquire)) {
+        throw runtime_error("Invalid device handle " + std::to_string(handle));
+    }
+    return deviceQueues_[handle].get();
+}
+
+APSEthernet::EthernetError APSEthernet::send(DeviceHandle handle, APSEthernetPacket msg, bool checkResponse) {
+    DeviceQueue * queue = get_queue(handle);
+    msg.header.dest = queue->devInfo.macAddr;
+    if (!checkResponse) {
+        SendGate::Guard guard(queue->gate, SendGate::CONTROL);
+        take_seqnums(queue, &msg, 1);
+        send_packet(queue, queue->devInfo.endpoint, msg);
+        return SUCCESS;
+    }
+    return send_control(queue, msg);
+}
+
+APSEthernet::EthernetError APSEthernet::send_control(DeviceQueue * queue, APSEthernetPacket & msg) {
+    //A single acknowledged packet is a request like any query, so its acknowledge comes back through the pending table
+    //and never touches the ring a bulk upload may be reading. The retries bound the wait; the timeout is only a backstop.
+    auto perTry = std::max(retransmit_timeout(queue, msg.header.command), queue->timer.max_timeout());
+    size_t timeoutMS = (queue->timer.max_retries() + 1) * std::chrono::duration_cast<std::chrono::milliseconds>(perTry).count() + 1;
+    EthernetError result = send_request(queue->handle, msg);
+    if (result != SUCCESS) {
+        return result;
+    }
+    APSEthernetPacket reply;
+    result = receive_reply(queue->handle, msg, reply, timeoutMS);
+    if (result == TIMEOUT) {
+        FILE_LOG(logERROR) << "No acknowledge from " << queue->serial << " for sequence number " << msg.header.seqNum;
+    }
+    return result;
+}
+
+namespace {
+//NOACK sets the top bit of the command nibble of the command word. Only the last packet of each chunk of ackEvery
+//asks for an acknowledge; with ackEvery zero none do.
+void mark_acknowledges(APSEthernetPacket * msg, size_t numPackets, unsigned ackEvery) {
+    for (size_t ct = 0; ct < numPackets; ct++) {
+        if (ackEvery == 0 || ((ct + 1) % ackEvery != 0 && ct + 1 != numPackets)) {
+            msg[ct].header.command.cmd |= (1 << 3);
+        } else {
+            msg[ct].header.command.cmd &= ~(1 << 3);
+        }
+    }
+}
+
+//Memory and bitfile writes have variants the APS2 doesn't acknowledge, so they can be streamed
+inline bool can_stream(const APSCommand_t & command) {
+    uint32_t cmd = command.cmd & 0x7;
+    return command.r_w == 0 && (cmd == static_cast<uint32_t>(APS_COMMANDS::USERIO_ACK) || cmd == static_cast<uint32_t>(APS_COMMANDS::FPGACONFIG_ACK));
+}
+}
+
+APSEthernet::EthernetError APSEthernet::send(DeviceHandle handle, vector<APSEthernetPacket> msg, unsigned ackEvery /* see header for default */) {
+    DeviceQueue * queue = get_queue(handle);
+    FILE_LOG(logDEBUG3) << "Sending " << msg.size() << " packets to " << queue->serial;
+    if (msg.empty()) {
+        return SUCCESS;
+    }
+    bool noACK = (ackEvery == 0);
+
+    SendGate::TrafficClass trafficClass = msg.size() == 1 ? SendGate::CONTROL : SendGate::BULK;
+    bool stream = !noACK && trafficClass == SendGate::BULK && queue->devInfo.streaming && can_stream(msg[0].header.command);
+
+    //Sequence numbers are filled in as the packets go out
+    for (auto & packet : msg) {
+        // insert the target MAC address - not really necessary anymore because UDP does filtering
+        packet.header.dest = queue->devInfo.macAddr;
+    }
+    mark_acknowledges(msg.data(), msg.size(), ackEvery);
+
+    EthernetError result = SUCCESS;
+    if (noACK) {
+        //A batch at a time so control traffic can get in between
+        for (size_t first = 0; first < msg.size(); first += MAX_SEND_BATCH) {
+            size_t batchSize = std::min(msg.size() - first, MAX_SEND_BATCH);
+            SendGate::Guard guard(queue->gate, trafficClass);
+            take_seqnums(queue, msg.data() + first, batchSize);
+            send_chunk(queue, msg.data() + first, batchSize);
+        }
+    } else if (trafficClass == SendGate::CONTROL) {
+        result = send_control(queue, msg[0]);
+    } else {
+        //Only acknowledged bulk transfers count as uploads, so single writes don't drag down the throughput figures
+        size_t payloadBytes = 0;
+        for (const auto & packet : msg) {
+            payloadBytes += 4 * packet.payload.size();
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> uploadGuard(queue->uploadLock);
+        if (stream) {
+            result = send_streamed(queue, msg.data(), msg.size(), ackEvery);
+        } else {
+            result = send_windowed(queue, msg.data(), msg.size(), ackEvery, trafficClass);
+        }
+        if (result == SUCCESS) {
+            queue->counters.add_upload(payloadBytes, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+        }
+    }
+    return result;
 }
 
-APSEthernet::EthernetError APSEthernet::send(string serial, vector<APSEthernetPacket> msg, unsigned ackEvery /* see header for default */) {
-    //Fill out the destination  MAC address
-    FILE_LOG(logDEBUG3) << "Sending " << msg.size() << " packets to " << serial;
-    auto iter = msg.begin();
-    bool noACK = false;
-    if (ackEvery == 0) {
-        noACK = true;
-        ackEvery = 1;
+void APSEthernet::take_seqnums(DeviceQueue * queue, APSEthernetPacket * msg, size_t numPackets) {
+    //Carry on from the device's running sequence number so the APS2 can spot lost or repeated packets. Called with
+    //the device's send gate held so the numbers reach the wire in the order they were taken.
+    for (size_t ct = 0; ct < numPackets; ct++) {
+        msg[ct].header.seqNum = queue->devInfo.seqNum++;
     }
+}
+
+APSEthernet::EthernetError APSEthernet::send_windowed(DeviceQueue * queue, APSEthernetPacket * msg, size_t numPackets, unsigned ackEvery, SendGate::TrafficClass trafficClass) {
+    /*
+     * Sliding-window transfer: keep up to ackWindow chunks of ackEvery packets in flight. Each chunk ends with
+     * a packet requesting an acknowledge; ACKs are matched to their packet by the echoed sequence number and the
+     * window advances as the oldest chunks are acknowledged.
+     *
+     * Lost packets are resent selectively. When the APS2 sees a gap in the sequence numbers it flags the SEQ bit
+     * on the acknowledge for the packet after the gap. The gap started somewhere after the last packet we heard
+     * about, so those packets are resent one by one, each asking for its own acknowledge. If the oldest chunk's
+     * acknowledge doesn't arrive within the retransmission timeout only its final packet is resent: any earlier loss
+     * in the chunk would have been flagged, and a lost final packet shows up as a gap when the resend arrives.
+     *
+     * Sequence numbers are taken a window at a time as the packets go out, so control traffic that slips in between
+     * windows keeps the APS2's sequence unbroken and chunks need not be numbered consecutively.
+     */
+    typedef std::chrono::steady_clock clock;
+    EthernetDevInfo & devInfo = queue->devInfo;
+    RetransmitTimer & timer = queue->timer;
+    PacingController & pacer = queue->pacer;
+
     // it's nice to have extra status on slow EPROM writes
     bool verbose = (msg[0].header.command.cmd == static_cast<uint32_t>(APS_COMMANDS::EPROMIO));
 
-    vector<APSEthernetPacket> buffer(ackEvery);
+    //Bulk uploads are paced to what the device can take; EPROM writes are held up by the flash instead. The flash
+    //controller isn't known to cope with queued writes, so those go one acknowledged packet at a time.
+    bool paced = (trafficClass == SendGate::BULK) && !verbose;
 
-    while (iter != msg.end()){
+    //Window state belongs to this transfer alone; repairs can push it past a window's worth of chunks
+    vector<InFlightChunk> inFlight;
+    inFlight.reserve(2 * devInfo.ackWindow);
 
-        //Copy the next chunk into a buffer
-        auto endPoint = iter + ackEvery;
-        if (endPoint > msg.end()) {
-            endPoint = msg.end();
-        } 
-        auto chunkSize = std::distance(iter, endPoint);
-        buffer.resize(chunkSize);
-        std::copy(iter, endPoint, buffer.begin());
+    //Anything still queued is a leftover from an earlier upload and can't acknowledge this transfer. The caller holds
+    //the device's upload lock, so no other transfer is reading the ring.
+    {
+        std::lock_guard<std::mutex> readGuard(queue->readLock);
+        while (!queue->packets.empty()) {
+            FILE_LOG(logDEBUG2) << "Discarding stale packet with sequence number " << queue->packets.front().header.seqNum;
+            queue->packets.pop();
+        }
+    }
+
+    size_t nextPacket = 0, ackedPackets = 0;
+    //Every packet before reportedCount has been acknowledged or had a gap flagged after it
+    size_t reportedCount = 0;
+    //Whether anything has been resent since new packets last went out
+    bool resent = false;
+    //Whether a packet has been lost since the overrun counters were last sampled
+    bool lostPacket = false;
+    auto lastProgress = clock::now();
+    auto nextSend = lastProgress;
+    unsigned retryct = 0;
+
+    auto resend_packet = [&](size_t idx){
+        SendGate::Guard guard(queue->gate, trafficClass);
+        if (msg[idx].header.command.cmd & (1 << 3)) {
+            APSEthernetPacket packet = msg[idx];
+            packet.header.command.cmd &= ~(1 << 3);
+            send_chunk(queue, &packet, 1);
+        } else {
+            send_chunk(queue, msg + idx, 1);
+        }
+        timer.retransmitCount++;
+        resent = true;
+    };
+
+    while (nextPacket < numPackets || !inFlight.empty()) {
+        //Once the first window is out, check now and again whether the device has been overrunning
+        if (paced && nextPacket > 0 && pacer.adaptive() && pacer.sample_due(lostPacket)) {
+            APSStatusBank_t status;
+            APSEthernetPacket reply;
+            if (read_status(queue, status, reply)) {
+                sample_overruns(queue, status);
+            }
+            lostPacket = false;
+        }
+
+        //Fill the window. Unpaced, the newly opened chunks all go out together; paced, a chunk at a time so control
+        //traffic can get in between. A resend, or a control packet that was lost or resent since our last send, means
+        //the APS2 sees a jump at the first packet that follows.
+        auto packetGap = paced ? pacer.packet_gap() : std::chrono::nanoseconds(0);
+        size_t window = verbose ? 1 : paced ? pacer.window(devInfo.ackWindow) : devInfo.ackWindow;
+        auto now = clock::now();
+        while (inFlight.size() < window && nextPacket < numPackets) {
+            SendGate::Guard guard(queue->gate, trafficClass);
+            bool jump = resent || guard.control_sent();
+            size_t windowStart = nextPacket, firstChunk = inFlight.size();
+            do {
+                size_t last = std::min(nextPacket + ackEvery, numPackets);
+                inFlight.push_back({nextPacket, last, false, false, false, jump && nextPacket == windowStart, false, now});
+                nextPacket = last;
+            } while (packetGap.count() == 0 && inFlight.size() < window && nextPacket < numPackets);
+            TransportCounters::raise(queue->counters.maxChunksInFlight, inFlight.size());
+            take_seqnums(queue, msg + windowStart, nextPacket - windowStart);
+            send_paced(queue, msg + windowStart, nextPacket - windowStart, packetGap, nextSend);
+            //Pacing may have held the chunks back so time them from when they went out
+            now = clock::now();
+            for (size_t ct = firstChunk; ct < inFlight.size(); ct++) {
+                inFlight[ct].sentAt = now;
+            }
+            resent = false;
+        }
+
+        //Wait for an acknowledge until the oldest outstanding chunk is due for a resend. Like TCP the timer restarts
+        //whenever something is acknowledged, as later chunks in a window queue up behind earlier ones at the APS2.
+        //TODO: how to check response mode/stat for success?
+        auto oldest = inFlight.end();
+        for (auto chunk = inFlight.begin(); chunk != inFlight.end(); ++chunk) {
+            if (!chunk->acked && (oldest == inFlight.end() || chunk->sentAt < oldest->sentAt)) {
+                oldest = chunk;
+            }
+        }
+        auto deadline = std::max(oldest->sentAt, lastProgress) + retransmit_timeout(queue, msg[oldest->first].header.command);
+        APSEthernetPacket response;
+        bool received;
+        {
+            std::lock_guard<std::mutex> readGuard(queue->readLock);
+            received = pop_packet(queue, response, deadline);
+        }
+        if (!received) {
+            timer.timeoutCount++;
+            if (++retryct > timer.max_retries()) {
+                FILE_LOG(logERROR) << "No acknowledge from " << queue->serial << " after " << retryct - 1 << " retries";
+                return TIMEOUT;
+            }
+            FILE_LOG(logDEBUG) << "No acknowledge for sequence number " << msg[oldest->last-1].header.seqNum << ", resending";
+            resend_packet(oldest->last - 1);
+            lostPacket = true;
+            oldest->retransmitted = true;
+            oldest->reordered |= (oldest->last < nextPacket);
+            oldest->sentAt = clock::now();
+            timer.backoff();
+            continue;
+        }
 
-        for (auto & packet : buffer ){
-            // insert the target MAC address - not really necessary anymore because UDP does filtering
-            packet.header.dest = devInfo_[serial].macAddr;
-            //NOACK sets the top bit of the command nibble of the command word
-            packet.header.command.cmd |= (1 << 3);
+        //Work out which packet the response is about from the chunk it falls in; chunks went out whole so their
+        //numbers run on. Anything outside the chunks in flight is stale or for a query.
+        size_t idx = numPackets;
+        for (auto & chunk : inFlight) {
+            uint16_t offset = response.header.seqNum - msg[chunk.first].header.seqNum;
+            if (offset < chunk.last - chunk.first) {
+                idx = chunk.first + offset;
+                break;
+            }
+        }
+        if (idx >= nextPacket) {
+            FILE_LOG(logDEBUG2) << "Ignoring unexpected acknowledge with sequence number " << response.header.seqNum;
+            continue;
         }
-        
-        //Apply acknowledge flag to last element of chunk
-        if (!noACK){
-            buffer.back().header.command.cmd &= ~(1 << 3);
+
+        //An acknowledge, or a duplicate report, for the final packet of a chunk or repair confirms it
+        now = clock::now();
+        for (auto & chunk : inFlight) {
+            if (!chunk.acked && chunk.last - 1 == idx) {
+                chunk.acked = true;
+                retryct = 0;
+                lastProgress = now;
+                timer.reset_backoff();
+                //Only chunks sent once give an unambiguous round trip
+                if (!chunk.retransmitted && msg[chunk.first].header.command.cmd != static_cast<uint32_t>(APS_COMMANDS::EPROMIO)) {
+                    timer.add_sample(std::chrono::duration_cast<std::chrono::microseconds>(now - chunk.sentAt));
+                    queue->counters.add_round_trip(std::chrono::duration_cast<std::chrono::microseconds>(now - chunk.sentAt));
+                }
+            }
         }
-        
-        auto result = send_chunk(serial, buffer, noACK);
-        if (result != SUCCESS){
-            return result;
+
+        if (response.header.command.seq && response.header.command.mode_stat == SEQUENCE_SKIP && idx >= reportedCount) {
+            //The APS2 missed the packets just before this one. Jumps we caused ourselves by resending aren't losses.
+            size_t gapStart = reportedCount;
+            bool expected = false;
+            for (auto & chunk : inFlight) {
+                if (chunk.afterResend && chunk.first <= idx) {
+                    gapStart = std::max(gapStart, chunk.first);
+                    expected |= (chunk.first == idx);
+                }
+                expected |= (chunk.reordered && chunk.last - 1 == idx);
+            }
+            if (!expected && gapStart < idx) {
+                FILE_LOG(logDEBUG) << "Sequence skip reported at " << response.header.seqNum << ", resending " << idx - gapStart << " packets";
+                for (size_t lost = gapStart; lost < idx; lost++) {
+                    resend_packet(lost);
+                    inFlight.push_back({lost, lost + 1, false, true, true, false, true, now});
+                }
+                lostPacket = true;
+                TransportCounters::raise(queue->counters.maxChunksInFlight, inFlight.size());
+            }
+        } else if (response.header.command.seq) {
+            FILE_LOG(logDEBUG2) << "Sequence error " << response.header.command.mode_stat << " reported at " << response.header.seqNum;
         }
-        std::advance(iter, chunkSize);
+        reportedCount = std::max(reportedCount, idx + 1);
 
-        if (verbose && (std::distance(msg.begin(), iter) % 1000 == 0)) {
-            FILE_LOG(logDEBUG) << "Write " << 100*std::distance(msg.begin(), iter)/msg.size() << "% complete";
+        //Slide the window past every acknowledged chunk at the front
+        auto firstUnacked = inFlight.begin();
+        while (firstUnacked != inFlight.end() && firstUnacked->acked) {
+            if (!firstUnacked->repair) {
+                ackedPackets += firstUnacked->last - firstUnacked->first;
+                if (verbose && (ackedPackets % 1000 == 0)) {
+                    FILE_LOG(logDEBUG) << "Write " << 100*ackedPackets/numPackets << "% complete";
+                }
+            }
+            ++firstUnacked;
         }
+        inFlight.erase(inFlight.begin(), firstUnacked);
     }
     return SUCCESS;
 }
 
-APSEthernet::EthernetError APSEthernet::send_chunk(string serial, vector<APSEthernetPacket> chunk, bool noACK){
-
-    unsigned seqNum, retryct = 0;
+void APSEthernet::send_chunk(DeviceQueue * queue, const APSEthernetPacket * msg, size_t numPackets){
+    if (backend_ == PACKET_MMAP_TRANSPORT && send_ring(queue, msg, numPackets)) {
+        return;
+    }
+    EthernetDevInfo & devInfo = queue->devInfo;
+    if (devInfo.sendBuffers.size() < MAX_SEND_BATCH) {
+        devInfo.sendBuffers.resize(MAX_SEND_BATCH);
+    }
+    size_t numBytes[MAX_SEND_BATCH];
 
-    while( retryct++ < 3){
-        seqNum = 0;
-        for (auto packet : chunk){
-            packet.header.seqNum = seqNum;
-            seqNum++;
+    for (size_t first = 0; first < numPackets; ) {
+        size_t batchSize = std::min(numPackets - first, MAX_SEND_BATCH);
+        for (size_t ct = 0; ct < batchSize; ct++) {
+            const APSEthernetPacket & packet = msg[first + ct];
             FILE_LOG(logDEBUG4) << "Packet command: " << print_APSCommand(packet.header.command);
-            socket_.send_to(asio::buffer(packet.serialize()), devInfo_[serial].endpoint);
+            numBytes[ct] = packet.serialize(devInfo.sendBuffers[ct].data);
         }
-        
-        if(noACK) break;
-        //Wait for acknowledge 
-        //TODO: how to check response mode/stat for success?
-        try{
-            auto response = receive(serial)[0];
-            break;
+        send_batch(queue, devInfo.endpoint, devInfo.sendBuffers.data(), numBytes, batchSize);
+        first += batchSize;
+    }
+}
+
+void APSEthernet::send_paced(DeviceQueue * queue, const APSEthernetPacket * msg, size_t numPackets, std::chrono::nanoseconds packetGap,
+    std::chrono::steady_clock::time_point & nextSend){
+    if (packetGap.count() == 0) {
+        send_chunk(queue, msg, numPackets);
+        return;
+    }
+    //One packet at a time, each no sooner than packetGap after the last. A sender that fell behind doesn't catch up
+    //with a burst.
+    for (size_t ct = 0; ct < numPackets; ct++) {
+        auto now = std::chrono::steady_clock::now();
+        if (nextSend - now > std::chrono::microseconds(200)) {
+            std::this_thread::sleep_until(nextSend - std::chrono::microseconds(100));
         }
-        catch (std::exception& e) {
-            FILE_LOG(logDEBUG) << "No acknowledge received, retrying ...";
+        while ((now = std::chrono::steady_clock::now()) < nextSend) {
+            spin_pause();
         }
+        send_chunk(queue, msg + ct, 1);
+        nextSend = now + packetGap;
     }
+}
 
-    if (retryct == 3){
-        return TIMEOUT;
+APSEthernet::EthernetError APSEthernet::send_streamed(DeviceQueue * queue, APSEthernetPacket * msg, size_t numPackets, unsigned ackEvery) {
+    /*
+     * Streaming upload: every packet goes out unacknowledged, paced but without waiting on the device, and delivery is
+     * checked once at the end against the APS2's status counters. Between a status read before the stream and one
+     * after it the device should have taken in one packet for every sequence number used in between, including any
+     * from queries on other threads. A shortfall is matched against the gaps the APS2 flagged on the way: it answers
+     * the packet after a gap even when that packet asked for no acknowledge, and a gap at the very end shows up on the
+     * final status reply. When the gaps account for exactly the packets missing, one each, we know which were lost
+     * and resend only those, with acknowledges. Requests the driver resent with an unchanged sequence number, such as
+     * the status read itself, arrive as duplicates and are taken off the received count. Anything we can't account
+     * for falls back to resending the whole transfer as a windowed one.
+     */
+    typedef std::chrono::steady_clock clock;
+    PacingController & pacer = queue->pacer;
+    APSStatusBank_t before, after;
+    APSEthernetPacket beforeReply, afterReply;
+
+    auto send_acknowledged = [&](){
+        mark_acknowledges(msg, numPackets, ackEvery);
+        return send_windowed(queue, msg, numPackets, ackEvery, SendGate::BULK);
+    };
+
+    //Anything still queued is a leftover from an earlier exchange
+    {
+        std::lock_guard<std::mutex> readGuard(queue->readLock);
+        while (!queue->packets.empty()) {
+            queue->packets.pop();
+        }
     }
-    return SUCCESS;
+    if (!read_status(queue, before, beforeReply)) {
+        return send_acknowledged();
+    }
+    if (pacer.adaptive()) {
+        sample_overruns(queue, before);
+    }
+    //Indices of packets the APS2 flagged as coming after a gap. Batches may be numbered apart if control traffic got
+    //in between them, so replies are placed by the batch they fall in, newest first.
+    vector<size_t> gaps;
+    vector<size_t> batchStarts;
+    auto collect_gaps = [&](){
+        std::lock_guard<std::mutex> readGuard(queue->readLock);
+        while (!queue->packets.empty()) {
+            APSEthernetPacket & response = queue->packets.front();
+            for (size_t batch = batchStarts.size(); batch-- > 0; ) {
+                size_t first = batchStarts[batch];
+                size_t last = batch + 1 < batchStarts.size() ? batchStarts[batch + 1] : numPackets;
+                uint16_t offset = response.header.seqNum - msg[first].header.seqNum;
+                if (offset < last - first) {
+                    if (response.header.command.seq && response.header.command.mode_stat == SEQUENCE_SKIP) {
+                        gaps.push_back(first + offset);
+                    } else {
+                        FILE_LOG(logDEBUG) << "Unexpected reply to streamed packet with sequence number " << response.header.seqNum;
+                    }
+                    break;
+                }
+            }
+            queue->packets.pop();
+        }
+    };
+
+    auto packetGap = pacer.packet_gap();
+    auto nextSend = clock::now();
+    size_t batchSize = packetGap.count() ? 1 : MAX_SEND_BATCH;
+    mark_acknowledges(msg, numPackets, 0);
+    for (size_t first = 0; first < numPackets; first += batchSize) {
+        size_t count = std::min(numPackets - first, batchSize);
+        {
+            SendGate::Guard guard(queue->gate, SendGate::BULK);
+            take_seqnums(queue, msg + first, count);
+            send_paced(queue, msg + first, count, packetGap, nextSend);
+        }
+        batchStarts.push_back(first);
+        collect_gaps();
+    }
+
+    //Replies to the stream are queued ahead of the status reply, so once it is in we have seen every gap flagged
+    if (!read_status(queue, after, afterReply, STREAM_VERIFY_TIMEOUT_MS)) {
+        return send_acknowledged();
+    }
+    collect_gaps();
+    if (afterReply.header.command.seq && afterReply.header.command.mode_stat == SEQUENCE_SKIP) {
+        gaps.push_back(numPackets);
+    }
+    if (pacer.adaptive()) {
+        sample_overruns(queue, after);
+    }
+
+    //Sequence numbers only run to 16 bits; anything else sent meanwhile is far fewer than a wrap
+    uint64_t expected = static_cast<uint16_t>(afterReply.header.seqNum - beforeReply.header.seqNum);
+    while (expected < numPackets) {
+        expected += 1 << 16;
+    }
+    uint32_t overruns = (after.fcsOverrunCount + after.packetOverrunCount) - (before.fcsOverrunCount + before.packetOverrunCount);
+    uint32_t duplicates = after.sequenceDupCount - before.sequenceDupCount;
+    uint64_t received = static_cast<uint32_t>(after.receivePacketCount - before.receivePacketCount - overruns - duplicates);
+    uint32_t skips = after.sequenceSkipCount - before.sequenceSkipCount;
+
+    std::sort(gaps.begin(), gaps.end());
+    gaps.erase(std::unique(gaps.begin(), gaps.end()), gaps.end());
+    //Any other packet resent out of order shows up as extra skips and rules out both of these
+    if (received == expected && skips == 0 && gaps.empty()) {
+        FILE_LOG(logDEBUG2) << "All " << numPackets << " streamed packets reached " << queue->serial;
+        return SUCCESS;
+    }
+    if (received < expected && expected - received == gaps.size() && skips == gaps.size() && gaps.front() > 0) {
+        FILE_LOG(logDEBUG) << "Resending " << gaps.size() << " of " << numPackets << " streamed packets to " << queue->serial;
+        vector<APSEthernetPacket> lost;
+        lost.reserve(gaps.size());
+        for (size_t gap : gaps) {
+            lost.push_back(msg[gap - 1]);
+        }
+        mark_acknowledges(lost.data(), lost.size(), 1);
+        return send_windowed(queue, lost.data(), lost.size(), 1, SendGate::BULK);
+    }
+    FILE_LOG(logDEBUG) << "Unable to account for streamed packets to " << queue->serial << " (expected " << expected << ", received "
+        << received << ", " << skips << " skips, " << gaps.size() << " gaps flagged); resending them all";
+    return send_acknowledged();
 }
 
+bool APSEthernet::read_status(DeviceQueue * queue, APSStatusBank_t & status, APSEthernetPacket & reply, unsigned timeoutMS) {
+    APSEthernetPacket request;
+    request.header.command.cmd = static_cast<uint32_t>(APS_COMMANDS::STATUS);
+    request.header.command.r_w = 1;
+    request.header.command.mode_stat = APS_STATUS_HOST;
+    if (query(queue->handle, request, reply, timeoutMS) != SUCCESS || reply.payload.size() < 16) {
+        FILE_LOG(logDEBUG) << "Unable to read the status registers of " << queue->serial;
+        return false;
+    }
+    std::copy(reply.payload.begin(), reply.payload.begin() + 16, status.array);
+    return true;
+}
 
-vector<APSEthernetPacket> APSEthernet::receive(string serial, size_t numPackets, size_t timeoutMS) {
-    //Read the packets coming back in up to the timeout
-    //Defaults: receive(string serial, size_t numPackets = 1, size_t timeoutMS = 1000);
-    std::chrono::time_point<std::chrono::steady_clock> start, end;
+void APSEthernet::sample_overruns(DeviceQueue * queue, const APSStatusBank_t & status) {
+    PacingController & pacer = queue->pacer;
+    if (pacer.add_sample(status.fcsOverrunCount + status.packetOverrunCount, queue->counters.packets_sent(), queue->devInfo.ackWindow)) {
+        FILE_LOG(logDEBUG) << queue->serial << " is overrunning; packet gap now " << pacer.packet_gap().count() << " ns, window "
+            << pacer.window(queue->devInfo.ackWindow);
+    }
+}
 
-    start = std::chrono::steady_clock::now();
-    size_t elapsedTime = 0;
+void APSEthernet::send_packet(DeviceQueue * queue, const udp::endpoint & endpoint, const APSEthernetPacket & packet){
+    if (backend_ == PACKET_MMAP_TRANSPORT && endpoint == queue->devInfo.endpoint && send_ring(queue, &packet, 1)) {
+        return;
+    }
+    //Single packets are serialized on the stack so queries from several threads don't share the device's buffers
+    WireBuffer buffer;
+    size_t numBytes = packet.serialize(buffer.data);
+    FILE_LOG(logDEBUG4) << "Packet command: " << print_APSCommand(packet.header.command);
+    send_batch(queue, endpoint, &buffer, &numBytes, 1);
+}
 
-    vector<APSEthernetPacket> outVec;
+void APSEthernet::send_batch(DeviceQueue * queue, const udp::endpoint & endpoint, const WireBuffer * buffers, const size_t * numBytes, size_t batchSize){
+    //A device's own socket is already connected so it goes without a destination
+    InterfaceSocket * hostInterface = queue->devInfo.hostInterface;
+    udp::socket & socket = queue->socket ? queue->socket->socket : (hostInterface ? hostInterface->socket : socket_);
+    bool connected = static_cast<bool>(queue->socket);
+    queue->counters.add_sent(batchSize, std::accumulate(numBytes, numBytes + batchSize, static_cast<size_t>(0)));
+#ifdef HAVE_SENDMMSG
+    //The packet ring falls back on batched sends too
+    if (backend_ != ASIO_TRANSPORT) {
+        mmsghdr msgs[MAX_SEND_BATCH];
+        iovec iovecs[MAX_SEND_BATCH];
+        std::memset(msgs, 0, sizeof(msgs));
+        for (size_t ct = 0; ct < batchSize; ct++) {
+            iovecs[ct].iov_base = const_cast<uint8_t *>(buffers[ct].data);
+            iovecs[ct].iov_len = numBytes[ct];
+            msgs[ct].msg_hdr.msg_iov = &iovecs[ct];
+            msgs[ct].msg_hdr.msg_iovlen = 1;
+            if (!connected) {
+                msgs[ct].msg_hdr.msg_name = const_cast<udp::endpoint::data_type *>(endpoint.data());
+                msgs[ct].msg_hdr.msg_namelen = endpoint.size();
+            }
+        }
 
-    while (elapsedTime < timeoutMS){
-        if (!msgQueues_[serial].empty()){
-            mLock_.lock();
-            outVec.push_back(msgQueues_[serial].front());
-            msgQueues_[serial].pop();
-            mLock_.unlock();
-            FILE_LOG(logDEBUG4) << "Received packet command: " << print_APSCommand(outVec.back().header.command);
-            if (outVec.size() == numPackets){
-                FILE_LOG(logDEBUG3) << "Received " << numPackets << " packets from " << serial;
-                return outVec;
+        //The kernel may take only part of the batch; asio also leaves the socket non-blocking so wait for space if need be
+        size_t sent = 0;
+        while (sent < batchSize) {
+            int result = sendmmsg(socket.native_handle(), msgs + sent, batchSize - sent, 0);
+            if (result >= 0) {
+                sent += result;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollfd pfd = {socket.native_handle(), POLLOUT, 0};
+                poll(&pfd, 1, -1);
+            } else if (errno != EINTR) {
+                FILE_LOG(logERROR) << "sendmmsg failed with error: " << strerror(errno);
+                throw runtime_error("Failed to send packets");
             }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        end = std::chrono::steady_clock::now();
-        elapsedTime =  std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
+        return;
+    }
+#endif
+    for (size_t ct = 0; ct < batchSize; ct++) {
+        if (connected) {
+            socket.send(asio::buffer(buffers[ct].data, numBytes[ct]));
+        } else {
+            socket.send_to(asio::buffer(buffers[ct].data, numBytes[ct]), endpoint);
+        }
+    }
+}
+
+bool APSEthernet::send_ring(DeviceQueue * queue, const APSEthernetPacket * msg, size_t numPackets){
+    /*
+     * Serialize the packets straight into the transmit ring and send them all with one call. Until the device has
+     * been heard from through the ring we don't know its link address; returning false sends through the socket
+     * instead, where the kernel resolves it, and the reply teaches us the address.
+     */
+    uint64_t linkAddr = queue->linkAddr.load(std::memory_order_relaxed);
+    if (!linkAddr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(ringLock_);
+    if (!packetRing_) {
+        return false;
+    }
+    uint32_t destAddr = queue->ipAddr;
+    uint16_t destPort = queue->devInfo.endpoint.port();
+    size_t numBytes = 0;
+    for (size_t ct = 0; ct < numPackets; ct++) {
+        FILE_LOG(logDEBUG4) << "Packet command: " << print_APSCommand(msg[ct].header.command);
+        uint8_t * payload = packetRing_->next_payload();
+        size_t packetBytes = msg[ct].serialize(payload);
+        packetRing_->commit(linkAddr, destAddr, destPort, packetBytes);
+        numBytes += packetBytes;
+    }
+    packetRing_->flush();
+    queue->counters.add_sent(numPackets, numBytes);
+    return true;
+}
+
+APSEthernet::EthernetError APSEthernet::set_ack_window(DeviceHandle handle, unsigned window) {
+    DeviceQueue * queue = get_queue(handle);
+    //Need at least one chunk in flight to make progress
+    window = std::max(window, 1u);
+    FILE_LOG(logDEBUG1) << "Setting ACK window for " << queue->serial << " to " << window << " chunks";
+    queue->devInfo.ackWindow = window;
+    return SUCCESS;
+}
+
+unsigned APSEthernet::get_ack_window(DeviceHandle handle) {
+    return get_queue(handle)->devInfo.ackWindow;
+}
+
+APSEthernet::EthernetError APSEthernet::set_max_payload(DeviceHandle handle, size_t numWords) {
+    DeviceQueue * queue = get_queue(handle);
+    //CNT can't go past the protocol limit; sizes above 362 words need jumbo frames on the link
+    numWords = std::max(std::min(numWords, APSEthernetPacket::MAX_PAYLOAD_WORDS), static_cast<size_t>(1));
+    FILE_LOG(logDEBUG1) << "Setting maximum payload for " << queue->serial << " to " << numWords << " words";
+    queue->devInfo.maxPayload = numWords;
+    return SUCCESS;
+}
+
+size_t APSEthernet::get_max_payload(DeviceHandle handle) {
+    return get_queue(handle)->devInfo.maxPayload;
+}
+
+size_t APSEthernet::get_path_max_payload(DeviceHandle handle) {
+    DeviceQueue * queue = get_queue(handle);
+    size_t numWords = APSEthernetPacket::MAX_PAYLOAD_WORDS;
+#ifdef IP_MTU
+    //Connecting a scratch socket looks up the route, and with it the MTU, without sending anything
+    udp::socket probe(ios_);
+    asio::error_code ec;
+    probe.connect(queue->devInfo.endpoint, ec);
+    int mtu = 0;
+    socklen_t length = sizeof(mtu);
+    if (!ec && getsockopt(probe.native_handle(), IPPROTO_IP, IP_MTU, &mtu, &length) == 0) {
+        //IPv4 and UDP headers, then the APS header
+        size_t headerBytes = 20 + 8 + APSEthernetPacket::NUM_HEADER_BYTES;
+        numWords = std::min(numWords, mtu > static_cast<int>(headerBytes) ? (mtu - headerBytes) / 4 : 1);
+        FILE_LOG(logDEBUG1) << "Path MTU to " << queue->serial << " is " << mtu << " bytes, so " << numWords << " word payloads fit";
     }
+#endif
+    return numWords;
+}
 
-    throw runtime_error("Timed out on receive");
+APSEthernet::EthernetError APSEthernet::set_ack_every(DeviceHandle handle, unsigned numPackets) {
+    DeviceQueue * queue = get_queue(handle);
+    numPackets = std::max(numPackets, 1u);
+    FILE_LOG(logDEBUG1) << "Setting chunk length for " << queue->serial << " to " << numPackets << " packets";
+    queue->devInfo.ackEvery = numPackets;
+    return SUCCESS;
+}
+
+APSEthernet::EthernetError APSEthernet::set_streaming(DeviceHandle handle, bool enable) {
+    DeviceQueue * queue = get_queue(handle);
+    FILE_LOG(logDEBUG1) << (enable ? "Enabling" : "Disabling") << " streaming uploads for " << queue->serial;
+    queue->devInfo.streaming = enable;
+    return SUCCESS;
 }
 
+bool APSEthernet::get_streaming(DeviceHandle handle) {
+    return get_queue(handle)->devInfo.streaming;
+}
+
+unsigned APSEthernet::get_ack_every(DeviceHandle handle) {
+    return get_queue(handle)->devInfo.ackEvery;
+}
+
+void APSEthernet::apply_profile(DeviceQueue * queue, const TransportProfile & profile) {
+    FILE_LOG(logDEBUG1) << "Using " << profile.maxPayload << " word payloads in chunks of " << profile.ackEvery << " with a window of "
+        << profile.ackWindow << " for " << queue->serial;
+    queue->devInfo.maxPayload = std::max(std::min(profile.maxPayload, APSEthernetPacket::MAX_PAYLOAD_WORDS), static_cast<size_t>(1));
+    queue->devInfo.ackEvery = std::max(profile.ackEvery, 1u);
+    queue->devInfo.ackWindow = std::max(profile.ackWindow, 1u);
+}
+
+APSEthernet::EthernetError APSEthernet::set_transport_profile(DeviceHandle handle, const TransportProfile & profile) {
+    DeviceQueue * queue = get_queue(handle);
+    std::lock_guard<std::mutex> guard(mLock_);
+    apply_profile(queue, profile);
+    //Without a MAC address there is nothing to remember it by
+    if (queue->devInfo.macAddr == MACAddr()) {
+        FILE_LOG(logWARNING) << "No MAC address known for " << queue->serial << " so its transport profile won't be kept";
+    } else {
+        profiles_[queue->devInfo.macAddr] = profile;
+    }
+    return SUCCESS;
+}
+
+bool APSEthernet::save_transport_profiles(const string & fileName) {
+    std::ofstream file(fileName);
+    if (!file.is_open()) {
+        FILE_LOG(logERROR) << "Unable to open " << fileName << " to save transport profiles";
+        return false;
+    }
+    //One device per line: MAC address, payload words, packets per chunk and chunks in flight
+    std::lock_guard<std::mutex> guard(mLock_);
+    for (auto & profile : profiles_) {
+        file << profile.first.to_string() << " " << profile.second.maxPayload << " " << profile.second.ackEvery << " "
+            << profile.second.ackWindow << endl;
+    }
+    return file.good();
+}
+
+bool APSEthernet::load_transport_profiles(const string & fileName) {
+    std::ifstream file(fileName);
+    if (!file.is_open()) {
+        FILE_LOG(logERROR) << "Unable to open " << fileName << " to load transport profiles";
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(mLock_);
+    string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        string mac;
+        TransportProfile profile;
+        if (!(fields >> mac >> profile.maxPayload >> profile.ackEvery >> profile.ackWindow) || MACAddr(mac) == MACAddr()) {
+            FILE_LOG(logWARNING) << "Skipping malformed transport profile: " << line;
+            continue;
+        }
+        profiles_[MACAddr(mac)] = profile;
+    }
+    FILE_LOG(logDEBUG1) << "Loaded " << profiles_.size() << " transport profiles from " << fileName;
+
+    //Devices that are already connected pick up their profile now
+    for (size_t slot = 0; slot < numDeviceQueues_.load(std::memory_order_relaxed); slot++) {
+        auto profileIter = profiles_.find(deviceQueues_[slot]->devInfo.macAddr);
+        if (profileIter != profiles_.end()) {
+            apply_profile(deviceQueues_[slot].get(), profileIter->second);
+        }
+    }
+    return true;
+}
+
+APSEthernet::EthernetError APSEthernet::set_transport(TransportBackend backend, const string & interface) {
+#ifndef HAVE_SENDMMSG
+    if (backend == MMSG_TRANSPORT) {
+        FILE_LOG(logERROR) << "Batched transport is not available on this platform";
+        return NOT_IMPLEMENTED;
+    }
+#endif
+#ifndef HAVE_PACKET_MMAP
+    if (backend == PACKET_MMAP_TRANSPORT) {
+        FILE_LOG(logERROR) << "Packet ring transport is not available on this platform";
+        return NOT_IMPLEMENTED;
+    }
+#endif
+    //Sends switch over immediately; the receive loop picks up the change when it next re-arms
+    FILE_LOG(logDEBUG1) << "Setting transport backend to " << backend;
+    std::lock_guard<std::mutex> guard(mLock_);
+    if (backend == PACKET_MMAP_TRANSPORT && multiInterface_) {
+        FILE_LOG(logERROR) << "The packet ring serves a single interface; turn off multiple interfaces first";
+        return INVALID_NETWORK_DEVICE;
+    }
+
+    //The device queues take a single producer, so the ring thread and the socket receivers must never feed them at the
+    //same time. Leaving the packet ring, or moving it to another interface, stops the ring thread before the sockets
+    //are heard again; datagrams arriving in between are lost and resent.
+    if (packetRing_) {
+        close_ring();
+        backend_ = MMSG_TRANSPORT;
+        drop_socket_datagrams(false);
+    }
+
+    if (backend == PACKET_MMAP_TRANSPORT) {
+        //The ring holds on to what arrives until its thread starts, which is only once the sockets are muted and every
+        //socket receiver has seen the new backend
+        std::unique_ptr<PacketRing> ring(new PacketRing());
+        if (!ring->open(interface, APS_PROTO)) {
+            return INVALID_NETWORK_DEVICE;
+        }
+        drop_socket_datagrams(true);
+        backend_ = backend;
+        wait_for_receivers();
+        {
+            std::lock_guard<std::mutex> ringGuard(ringLock_);
+            packetRing_ = std::move(ring);
+        }
+        ringRunning_ = true;
+        ringThread_ = std::thread([this](){ ring_loop(); });
+        return SUCCESS;
+    }
+    backend_ = backend;
+    return SUCCESS;
+}
+
+void APSEthernet::wait_for_receivers() {
+    /*
+     * Wait until every thread serving sockets has finished with the datagram it was handling. Each io_service is run
+     * by a single thread so once a job posted to it has run, anything it dispatches from then on sees the current
+     * backend. Called with mLock_ held.
+     */
+    vector<std::future<void>> done;
+    auto post_marker = [&done](asio::io_service & ios){
+        auto marker = std::make_shared<std::promise<void>>();
+        done.push_back(marker->get_future());
+        ios.post([marker](){ marker->set_value(); });
+    };
+    post_marker(ios_);
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+    for (size_t ct = 0; ct < numQueues; ct++) {
+        DeviceSocket * deviceSocket = deviceQueues_[ct]->socket.get();
+        if (deviceSocket && deviceSocket->ios) {
+            post_marker(*deviceSocket->ios);
+        }
+    }
+    for (auto & marker : done) {
+        marker.wait();
+    }
+}
+
+void APSEthernet::ring_loop() {
+    //Sleep in the ring's poll normally; in low-latency mode keep checking it without ever blocking
+    PacketRing::Handler handler = [this](uint64_t srcMAC, uint32_t srcAddr, uint16_t srcPort, const uint8_t * payload, size_t length){
+        learn_link_addr(srcAddr, srcMAC);
+        sort_packet(payload, length, udp::endpoint(asio::ip::address_v4(srcAddr), srcPort));
+    };
+    while (ringRunning_) {
+        bool lowLatency = lowLatency_;
+        if (packetRing_->receive(lowLatency ? 0 : RING_POLL_MS, handler) == 0 && lowLatency) {
+            spin_pause();
+        }
+    }
+}
+
+void APSEthernet::learn_link_addr(uint32_t ipAddr, uint64_t linkAddr) {
+    //Devices in the table keep their own copy for the senders; anyone else is remembered until they are connected
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+    for (size_t ct = 0; ct < numQueues; ct++) {
+        if (deviceQueues_[ct]->ipAddr == ipAddr) {
+            if (deviceQueues_[ct]->linkAddr.load(std::memory_order_relaxed) != linkAddr) {
+                deviceQueues_[ct]->linkAddr = linkAddr;
+            }
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> guard(enumerateLock_);
+    linkAddrs_[ipAddr] = linkAddr;
+}
+
+void APSEthernet::close_ring() {
+    if (ringThread_.joinable()) {
+        ringRunning_ = false;
+        ringThread_.join();
+    }
+    std::lock_guard<std::mutex> guard(ringLock_);
+    packetRing_.reset();
+}
+
+void APSEthernet::drop_socket_datagrams(bool drop) {
+    //Called with mLock_ held
+    drop_datagrams(socket_, drop);
+    for (size_t ct = 0; ct < numInterfaces_; ct++) {
+        drop_datagrams(interfaces_[ct]->socket, drop);
+    }
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+    for (size_t ct = 0; ct < numQueues; ct++) {
+        if (deviceQueues_[ct]->socket) {
+            drop_datagrams(deviceQueues_[ct]->socket->socket, drop);
+        }
+    }
+}
+
+APSEthernet::TransportBackend APSEthernet::get_transport() const {
+    return backend_;
+}
+
+APSEthernet::EthernetError APSEthernet::set_device_sockets(bool enable, bool dedicatedThreads, int firstCore) {
+#ifndef HAVE_DEVICE_SOCKETS
+    if (enable) {
+        FILE_LOG(logERROR) << "Per-device sockets are not available on this platform";
+        return NOT_IMPLEMENTED;
+    }
+#endif
+    //Devices that already have a socket keep it; the setting applies to devices as they are connected
+    FILE_LOG(logDEBUG1) << "Setting per-device sockets " << (enable ? "on" : "off") << (dedicatedThreads ? " with dedicated I/O threads" : "");
+    std::lock_guard<std::mutex> guard(mLock_);
+    deviceSockets_ = enable;
+    dedicatedThreads_ = dedicatedThreads;
+    firstCore_ = firstCore;
+    return SUCCESS;
+}
+
+void APSEthernet::open_device_socket(DeviceQueue * queue, size_t slot, const asio::ip::address_v4 & addr) {
+    /*
+     * Open a socket connected to the device. It shares the APS_PROTO port with the broadcast socket and the kernel
+     * hands the device's datagrams to the connected socket, so there is no sorting by sender on our side.
+     * Called with mLock_ held.
+     */
+    std::unique_ptr<DeviceSocket> deviceSocket(new DeviceSocket(dedicatedThreads_ ? new asio::io_service() : nullptr, ios_));
+    udp::socket & socket = deviceSocket->socket;
+    //A device on one of several interfaces is bound to that interface's address so its socket, not the interface's,
+    //gets its datagrams
+    InterfaceSocket * hostInterface = queue->devInfo.hostInterface;
+    std::error_code ec;
+    socket.open(udp::v4(), ec);
+    if (!ec) socket.set_option(udp::socket::reuse_address(true), ec);
+    if (!ec && hostInterface) bind_to_interface(socket, hostInterface->name);
+    if (!ec) socket.bind(udp::endpoint(hostInterface ? hostInterface->address : asio::ip::address_v4::any(), APS_PROTO), ec);
+    if (!ec) socket.connect(udp::endpoint(addr, APS_PROTO), ec);
+    if (ec) {
+        FILE_LOG(logWARNING) << "Unable to open a socket for " << addr.to_string() << ": " << ec.message() << "; using the shared socket";
+        return;
+    }
+
+    apply_socket_buffers(socket);
+    apply_low_latency(socket);
+    enable_drop_counts(socket);
+
+    //The packet ring delivers the device's datagrams while it is in use
+    if (backend_ == PACKET_MMAP_TRANSPORT) {
+        drop_datagrams(socket, true);
+    }
+
+    DeviceSocket * rawSocket = deviceSocket.get();
+    setup_receive(socket, rawSocket->receivedData, rawSocket->senderEndpoint, rawSocket->kernelDrops, queue);
+    if (rawSocket->ios) {
+        rawSocket->thread = std::thread([this, rawSocket](){ receive_loop(*rawSocket->ios); });
+#ifdef HAVE_DEVICE_SOCKETS
+        if (firstCore_ >= 0 && !pin_thread(rawSocket->thread, firstCore_ + slot)) {
+            FILE_LOG(logWARNING) << "Unable to pin the I/O thread for " << addr.to_string() << " to core " << firstCore_ + slot;
+        }
+#endif
+    }
+    FILE_LOG(logDEBUG1) << "Opened device socket for " << addr.to_string();
+    queue->socket = std::move(deviceSocket);
+}
+
+APSEthernet::EthernetError APSEthernet::set_interfaces(bool enable, const vector<string> & interfaces) {
+#ifndef HAVE_INTERFACE_SOCKETS
+    if (enable) {
+        FILE_LOG(logERROR) << "Multiple interfaces are not available on this platform";
+        return NOT_IMPLEMENTED;
+    }
+#endif
+    std::lock_guard<std::mutex> guard(mLock_);
+    if (enable && backend_ == PACKET_MMAP_TRANSPORT) {
+        FILE_LOG(logERROR) << "The packet ring serves a single interface; pick another transport first";
+        return INVALID_NETWORK_DEVICE;
+    }
+    vector<HostInterface> found;
+    if (enable) {
+        found = host_interfaces(interfaces);
+        for (auto & name : interfaces) {
+            if (std::none_of(found.begin(), found.end(), [&](const HostInterface & hostInterface){ return hostInterface.name == name; })) {
+                FILE_LOG(logERROR) << "Network interface " << name << " is not up or has no IPv4 address";
+                return INVALID_NETWORK_DEVICE;
+            }
+        }
+        if (found.empty()) {
+            FILE_LOG(logERROR) << "No network interface is up with an IPv4 address";
+            return INVALID_NETWORK_DEVICE;
+        }
+    }
+
+    //Interfaces dropped from the list keep their sockets, as connected devices send through them until they are
+    //connected again
+    std::lock_guard<std::mutex> enumerateGuard(enumerateLock_);
+    for (size_t ct = 0; ct < numInterfaces_; ct++) {
+        interfaces_[ct]->active = false;
+    }
+    for (auto & hostInterface : found) {
+        bool isOpen = false;
+        for (size_t ct = 0; ct < numInterfaces_; ct++) {
+            if (interfaces_[ct]->name == hostInterface.name && interfaces_[ct]->address == hostInterface.address) {
+                interfaces_[ct]->active = true;
+                isOpen = true;
+                break;
+            }
+        }
+        if (!isOpen && !open_interface_socket(hostInterface.name, hostInterface.address, hostInterface.netmask)) {
+            return INVALID_NETWORK_DEVICE;
+        }
+    }
+    multiInterface_ = enable;
+    FILE_LOG(logDEBUG1) << "Setting multiple interfaces " << (enable ? "on" : "off") << " with " << found.size() << " interfaces";
+    return SUCCESS;
+}
+
+bool APSEthernet::open_interface_socket(const string & name, const asio::ip::address_v4 & address, const asio::ip::address_v4 & netmask) {
+    /*
+     * Open a socket bound to an interface's address on the APS_PROTO port. The kernel prefers it to the shared socket
+     * for datagrams to that address, so replies from the devices on the interface arrive here, and sends from it leave
+     * by that interface. Called with mLock_ and enumerateLock_ held.
+     */
+    if (numInterfaces_ == MAX_HOST_INTERFACES) {
+        FILE_LOG(logERROR) << "Cannot use more than " << MAX_HOST_INTERFACES << " interfaces";
+        return false;
+    }
+    std::unique_ptr<InterfaceSocket> hostInterface(new InterfaceSocket(ios_, name, address, netmask));
+    udp::socket & socket = hostInterface->socket;
+    std::error_code ec;
+    socket.open(udp::v4(), ec);
+    if (!ec) socket.set_option(udp::socket::reuse_address(true), ec);
+    if (!ec) bind_to_interface(socket, name);
+    if (!ec) socket.bind(udp::endpoint(address, APS_PROTO), ec);
+    if (!ec) socket.set_option(asio::socket_base::broadcast(true), ec);
+    if (ec) {
+        FILE_LOG(logERROR) << "Unable to open a socket on " << name << ": " << ec.message();
+        return false;
+    }
+
+    apply_socket_buffers(socket);
+    apply_low_latency(socket);
+    enable_drop_counts(socket);
+
+    InterfaceSocket * rawSocket = hostInterface.get();
+    setup_receive(socket, rawSocket->receivedData, rawSocket->senderEndpoint, rawSocket->kernelDrops, nullptr);
+    FILE_LOG(logDEBUG1) << "Opened socket on interface " << name << " with address " << address.to_string();
+    interfaces_[numInterfaces_++] = std::move(hostInterface);
+    return true;
+}
+
+InterfaceSocket * APSEthernet::find_interface(uint32_t ipAddr) {
+    //Called with enumerateLock_ held. Should two interfaces share a subnet the first one listed wins.
+    for (size_t ct = 0; ct < numInterfaces_; ct++) {
+        if (interfaces_[ct]->active && interfaces_[ct]->on_subnet(ipAddr)) {
+            return interfaces_[ct].get();
+        }
+    }
+    return nullptr;
+}
+
+APSEthernet::EthernetError APSEthernet::set_low_latency(bool enable, int receiveCore, unsigned busyPollUS) {
+    FILE_LOG(logDEBUG1) << "Setting low-latency mode " << (enable ? "on" : "off");
+    if (receiveCore >= 0 && !pin_thread(receiveThread_, receiveCore)) {
+        FILE_LOG(logWARNING) << "Unable to pin the receive thread to core " << receiveCore;
+    }
+    std::lock_guard<std::mutex> guard(mLock_);
+    lowLatency_ = enable;
+    busyPollUS_ = enable ? busyPollUS : 0;
+    //Every socket gets the options, and sockets opened later get them as they are opened
+    apply_low_latency(socket_);
+    for (size_t ct = 0; ct < numInterfaces_; ct++) {
+        apply_low_latency(interfaces_[ct]->socket);
+    }
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+    for (size_t ct = 0; ct < numQueues; ct++) {
+        if (deviceQueues_[ct]->socket) {
+            apply_low_latency(deviceQueues_[ct]->socket->socket);
+            //Wake a dedicated thread in case it is asleep in run_one()
+            if (deviceQueues_[ct]->socket->ios) {
+                deviceQueues_[ct]->socket->ios->post([](){});
+            }
+        }
+    }
+    //Wake the receive thread in case it is asleep in run_one() so it starts polling straight away
+    ios_.post([](){});
+    return SUCCESS;
+}
+
+void APSEthernet::apply_low_latency(udp::socket & socket) {
+    //A larger receive buffer and busy polling while low-latency mode is on; turning it off stops the busy polling and
+    //puts back the buffer size from set_socket_buffers, if one was set
+    if (lowLatency_) {
+        std::error_code ec;
+        socket.set_option(asio::socket_base::receive_buffer_size(std::max(LOW_LATENCY_RCVBUF, receiveBufferBytes_)), ec);
+        if (ec) {
+            FILE_LOG(logWARNING) << "Unable to enlarge the receive buffer: " << ec.message();
+        }
+    } else {
+        apply_socket_buffers(socket);
+    }
+#if defined(HAVE_DEVICE_SOCKETS) && defined(SO_BUSY_POLL)
+    int busyPoll = busyPollUS_;
+    //Needs CAP_NET_ADMIN to go past net.core.busy_read. Nothing to do if it was never turned on.
+    int current = 0;
+    socklen_t length = sizeof(current);
+    getsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &current, &length);
+    if (busyPoll != current && setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) != 0) {
+        FILE_LOG(logWARNING) << "Unable to set SO_BUSY_POLL: " << strerror(errno);
+    }
+#endif
+}
+
+bool APSEthernet::get_low_latency() const {
+    return lowLatency_;
+}
+
+APSEthernet::EthernetError APSEthernet::set_socket_buffers(int receiveBytes, int sendBytes) {
+    FILE_LOG(logDEBUG1) << "Setting socket buffers to " << receiveBytes << " bytes receive and " << sendBytes << " bytes send";
+    std::lock_guard<std::mutex> guard(mLock_);
+    receiveBufferBytes_ = std::max(receiveBytes, 0);
+    sendBufferBytes_ = std::max(sendBytes, 0);
+    apply_socket_buffers(socket_);
+    apply_low_latency(socket_);
+    for (size_t ct = 0; ct < numInterfaces_; ct++) {
+        apply_socket_buffers(interfaces_[ct]->socket);
+        apply_low_latency(interfaces_[ct]->socket);
+    }
+    size_t numQueues = numDeviceQueues_.load(std::memory_order_acquire);
+    for (size_t ct = 0; ct < numQueues; ct++) {
+        if (deviceQueues_[ct]->socket) {
+            apply_socket_buffers(deviceQueues_[ct]->socket->socket);
+            apply_low_latency(deviceQueues_[ct]->socket->socket);
+        }
+    }
+    return SUCCESS;
+}
+
+void APSEthernet::apply_socket_buffers(udp::socket & socket) {
+    /*
+     * Ask for the requested buffer sizes. The kernel quietly caps them at net.core.rmem_max/wmem_max, so when we come
+     * up short try the privileged variants that ignore the cap before settling for what we got.
+     */
+    auto set_size = [&socket](int option, int forceOption, int bytes, const char * name){
+        if (bytes <= 0) {
+            return;
+        }
+        int size = bytes;
+        socklen_t length = sizeof(size);
+        setsockopt(socket.native_handle(), SOL_SOCKET, option, reinterpret_cast<const char *>(&size), sizeof(size));
+        getsockopt(socket.native_handle(), SOL_SOCKET, option, reinterpret_cast<char *>(&size), &length);
+        //Linux reports double what was asked for to account for its bookkeeping
+        if (size < bytes && forceOption) {
+            size = bytes;
+            setsockopt(socket.native_handle(), SOL_SOCKET, forceOption, reinterpret_cast<const char *>(&size), sizeof(size));
+            length = sizeof(size);
+            getsockopt(socket.native_handle(), SOL_SOCKET, option, reinterpret_cast<char *>(&size), &length);
+        }
+        if (size < bytes) {
+            FILE_LOG(logWARNING) << "Asked for a " << bytes << " byte " << name << " buffer but only got " << size << " bytes";
+        } else {
+            FILE_LOG(logDEBUG1) << "Socket " << name << " buffer is " << size << " bytes";
+        }
+    };
+#ifdef SO_RCVBUFFORCE
+    set_size(SO_RCVBUF, SO_RCVBUFFORCE, receiveBufferBytes_, "receive");
+    set_size(SO_SNDBUF, SO_SNDBUFFORCE, sendBufferBytes_, "send");
+#else
+    set_size(SO_RCVBUF, 0, receiveBufferBytes_, "receive");
+    set_size(SO_SNDBUF, 0, sendBufferBytes_, "send");
+#endif
+}
+
+vector<APSEthernetPacket> APSEthernet::receive(DeviceHandle handle, size_t numPackets, size_t timeoutMS) {
+    //Read the packets coming back in up to the timeout
+    //Defaults: receive(DeviceHandle handle, size_t numPackets = 1, size_t timeoutMS = 10000);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMS);
+
+    vector<APSEthernetPacket> outVec(numPackets);
+
+    DeviceQueue * queue = get_queue(handle);
+    std::lock_guard<std::mutex> readGuard(queue->readLock);
+
+    for (auto & packet : outVec) {
+        if (!pop_packet(queue, packet, deadline)) {
+            throw runtime_error("Timed out on receive");
+        }
+    }
+
+    FILE_LOG(logDEBUG3) << "Received " << numPackets << " packets from " << queue->serial;
+    return outVec;
+}
+
+APSEthernet::EthernetError APSEthernet::receive(DeviceHandle handle, APSEthernetPacket & packet, size_t timeoutMS) {
+    //Single packet receive into caller storage; this doesn't allocate so it is used on the hot paths
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMS);
+
+    DeviceQueue * queue = get_queue(handle);
+    std::lock_guard<std::mutex> readGuard(queue->readLock);
+
+    return pop_packet(queue, packet, deadline) ? SUCCESS : TIMEOUT;
+}
+
+bool APSEthernet::pop_packet(DeviceQueue * queue, APSEthernetPacket & packet, const std::chrono::steady_clock::time_point & deadline) {
+    //In low-latency mode spin until the packet turns up
+    if (lowLatency_) {
+        while (queue->packets.empty()) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            spin_pause();
+        }
+    }
+    //Otherwise rather than polling we sleep on the device's condition variable which sort_packet signals when we are waiting
+    if (queue->packets.empty()) {
+        std::unique_lock<std::mutex> lock(queue->waitLock);
+        queue->waiting = true;
+        bool arrived = queue->packetArrived.wait_until(lock, deadline, [queue](){ return !queue->packets.empty(); });
+        queue->waiting = false;
+        if (!arrived) {
+            return false;
+        }
+    }
+    packet = queue->packets.front();
+    queue->packets.pop();
+    FILE_LOG(logDEBUG4) << "Received packet command: " << print_APSCommand(packet.header.command);
+    return true;
+}
+
+APSEthernet::EthernetError APSEthernet::send_request(DeviceHandle handle, APSEthernetPacket & request) {
+    DeviceQueue * queue = get_queue(handle);
+    EthernetDevInfo & devInfo = queue->devInfo;
+    request.header.dest = devInfo.macAddr;
+    //Queries always want an answer
+    request.header.command.cmd &= ~(1 << 3);
+    request.header.command.ack = 0;
+
+    {
+        //Reserve a slot in the pending table, waiting for another query to finish if they are all taken. This has to
+        //happen outside the send gate as those queries may need the gate to resend.
+        std::unique_lock<std::mutex> lock(queue->pendingLock);
+        queue->replyArrived.wait(lock, [&](){ return queue->numPending < MAX_OUTSTANDING_REQUESTS; });
+        TransportCounters::raise(queue->counters.maxPendingRequests, ++queue->numPending);
+    }
+    issue_request(queue, request, nullptr);
+    return SUCCESS;
+}
+
+void APSEthernet::issue_request(DeviceQueue * queue, APSEthernetPacket & request, std::shared_ptr<AsyncQuery> async) {
+    //Fill in the slot reserved by the caller and send. Queries go ahead of any bulk transfer's next window.
+    SendGate::Guard guard(queue->gate, SendGate::CONTROL);
+    {
+        std::lock_guard<std::mutex> lock(queue->pendingLock);
+        auto slot = std::find_if(queue->pending.begin(), queue->pending.end(), [](const PendingRequest & slot){ return !slot.active; });
+
+        //Shares the device's running sequence number with bulk transfers, see take_seqnums
+        take_seqnums(queue, &request, 1);
+        slot->seqNum = request.header.seqNum;
+        slot->command = request.header.command.packed & 0x1F000000u;
+        slot->answered = false;
+        slot->retransmitted = false;
+        slot->sentAt = std::chrono::steady_clock::now();
+        slot->async = async;
+        slot->active = true;
+    }
+
+    FILE_LOG(logDEBUG3) << "Sending request with sequence number " << request.header.seqNum << " to " << queue->serial;
+    send_packet(queue, queue->devInfo.endpoint, request);
+}
+
+APSEthernet::EthernetError APSEthernet::receive_reply(DeviceHandle handle, const APSEthernetPacket & request, APSEthernetPacket & reply, size_t timeoutMS) {
+    /*
+     * Wait for the reply to a request from send_request. The request is resent whenever the retransmission
+     * timeout expires until it is answered, the retries run out or timeoutMS has passed.
+     */
+    typedef std::chrono::steady_clock clock;
+    auto deadline = clock::now() + std::chrono::milliseconds(timeoutMS);
+    DeviceQueue * queue = get_queue(handle);
+    RetransmitTimer & timer = queue->timer;
+    uint16_t seqNum = request.header.seqNum;
+
+    std::unique_lock<std::mutex> lock(queue->pendingLock);
+    auto slot = std::find_if(queue->pending.begin(), queue->pending.end(), [seqNum](const PendingRequest & slot){
+        return slot.active && slot.seqNum == seqNum;
+    });
+    if (slot == queue->pending.end()) {
+        FILE_LOG(logERROR) << "No outstanding request with sequence number " << seqNum << " for " << queue->serial;
+        return INVALID_APS_ID;
+    }
+
+    bool answered = false;
+    for (unsigned retryct = 0; ; retryct++) {
+        auto resendTime = std::min(slot->sentAt + retransmit_timeout(queue, request.header.command), deadline);
+        if (lowLatency_) {
+            //Watch for the reply without the lock so the receive thread is never held up
+            lock.unlock();
+            while (!slot->answered && clock::now() < resendTime) {
+                spin_pause();
+            }
+            lock.lock();
+            answered = slot->answered;
+        } else {
+            answered = queue->replyArrived.wait_until(lock, resendTime, [&](){ return slot->answered.load(); });
+        }
+        if (answered || resendTime == deadline || retryct == timer.max_retries()) {
+            break;
+        }
+        timer.timeoutCount++;
+        timer.backoff();
+        FILE_LOG(logDEBUG) << "No reply to sequence number " << seqNum << " from " << queue->serial << ", resending";
+        slot->retransmitted = true;
+        slot->sentAt = clock::now();
+        //Don't hold up the receive thread while we are on the wire
+        lock.unlock();
+        {
+            SendGate::Guard guard(queue->gate, SendGate::CONTROL);
+            send_packet(queue, queue->devInfo.endpoint, request);
+        }
+        timer.retransmitCount++;
+        lock.lock();
+    }
+
+    if (answered) {
+        reply = slot->reply;
+        timer.reset_backoff();
+        if (!slot->retransmitted && request.header.command.cmd != static_cast<uint32_t>(APS_COMMANDS::EPROMIO)) {
+            timer.add_sample(std::chrono::duration_cast<std::chrono::microseconds>(slot->answeredAt - slot->sentAt));
+            queue->counters.add_round_trip(std::chrono::duration_cast<std::chrono::microseconds>(slot->answeredAt - slot->sentAt));
+        }
+    } else {
+        timer.timeoutCount++;
+        //Once the slot is released a late reply no longer matches so it can't be mistaken for the answer to a later query
+        FILE_LOG(logDEBUG) << "Timed out waiting for reply to sequence number " << seqNum << " from " << queue->serial;
+    }
+    release_request(queue, *slot);
+    return answered ? SUCCESS : TIMEOUT;
+}
+
+APSEthernet::EthernetError APSEthernet::query(DeviceHandle handle, APSEthernetPacket request, APSEthernetPacket & reply, size_t timeoutMS) {
+    EthernetError result = send_request(handle, request);
+    if (result != SUCCESS) {
+        return result;
+    }
+    return receive_reply(handle, request, reply, timeoutMS);
+}
+
+void APSEthernet::async_query(DeviceHandle handle, APSEthernetPacket request, ReplyHandler handler) {
+    DeviceQueue * queue = get_queue(handle);
+    request.header.dest = queue->devInfo.macAddr;
+    //Queries always want an answer
+    request.header.command.cmd &= ~(1 << 3);
+    request.header.command.ack = 0;
+    auto query = std::make_shared<AsyncQuery>(workIos_, queue, request, handler);
+    {
+        //Rather than wait for a slot the query queues for one; release_request sends it on
+        std::lock_guard<std::mutex> lock(queue->pendingLock);
+        if (queue->numPending >= MAX_OUTSTANDING_REQUESTS) {
+            queue->waitingQueries.push_back(query);
+            return;
+        }
+        TransportCounters::raise(queue->counters.maxPendingRequests, ++queue->numPending);
+    }
+    issue_async(query);
+}
+
+void APSEthernet::issue_async(std::shared_ptr<AsyncQuery> query) {
+    //The reply may beat the timer being set; the timer then finds the query finished and does nothing
+    issue_request(query->queue, query->request, query);
+    query->timer.expires_from_now(retransmit_timeout(query->queue, query->request.header.command));
+    query->timer.async_wait([this, query](const asio::error_code &){ async_timeout(query); });
+}
+
+void APSEthernet::async_timeout(std::shared_ptr<AsyncQuery> query) {
+    DeviceQueue * queue = query->queue;
+    RetransmitTimer & timer = queue->timer;
+    uint16_t seqNum = query->request.header.seqNum;
+    {
+        std::lock_guard<std::mutex> lock(queue->pendingLock);
+        if (query->finished) {
+            return;
+        }
+        auto slot = std::find_if(queue->pending.begin(), queue->pending.end(), [&](const PendingRequest & slot){ return slot.async == query; });
+        timer.timeoutCount++;
+        if (query->retries == timer.max_retries()) {
+            query->finished = true;
+            release_request(queue, *slot);
+        } else {
+            query->retries++;
+            timer.backoff();
+            slot->retransmitted = true;
+            slot->sentAt = std::chrono::steady_clock::now();
+        }
+    }
+
+    if (query->finished) {
+        FILE_LOG(logDEBUG) << "Timed out waiting for reply to sequence number " << seqNum << " from " << queue->serial;
+        call_handler(query->handler, TIMEOUT, APSEthernetPacket());
+        return;
+    }
+    FILE_LOG(logDEBUG) << "No reply to sequence number " << seqNum << " from " << queue->serial << ", resending";
+    {
+        SendGate::Guard guard(queue->gate, SendGate::CONTROL);
+        send_packet(queue, queue->devInfo.endpoint, query->request);
+    }
+    timer.retransmitCount++;
+    query->timer.expires_from_now(retransmit_timeout(queue, query->request.header.command));
+    query->timer.async_wait([this, query](const asio::error_code &){ async_timeout(query); });
+}
+
+void APSEthernet::post(DeviceHandle handle, std::function<void()> job) {
+    post_async(handle, [job](std::function<void()> done){
+        job();
+        done();
+    });
+}
+
+void APSEthernet::post_async(DeviceHandle handle, AsyncJob job) {
+    //Each device keeps its own line of jobs so its operations stay in order; only the front one is on the workers
+    DeviceQueue * queue = get_queue(handle);
+    bool idle;
+    {
+        std::lock_guard<std::mutex> guard(queue->jobLock);
+        idle = queue->jobs.empty();
+        queue->jobs.push_back(job);
+    }
+    if (idle) {
+        run_next_job(queue);
+    }
+}
+
+void APSEthernet::run_next_job(DeviceQueue * queue) {
+    workIos_.post([this, queue](){
+        AsyncJob job;
+        {
+            std::lock_guard<std::mutex> guard(queue->jobLock);
+            job = queue->jobs.front();
+        }
+        //Start the device's next job once this one is done, however many times it says so
+        auto finished = std::make_shared<std::atomic<bool>>(false);
+        auto done = [this, queue, finished](){
+            if (finished->exchange(true)) {
+                return;
+            }
+            bool more;
+            {
+                std::lock_guard<std::mutex> guard(queue->jobLock);
+                queue->jobs.pop_front();
+                more = !queue->jobs.empty();
+            }
+            if (more) {
+                run_next_job(queue);
+            }
+        };
+        //An escaping exception would take down the worker thread with it
+        try {
+            job(done);
+        } catch (std::exception & e) {
+            FILE_LOG(logERROR) << "Asynchronous operation failed: " << e.what();
+            done();
+        }
+    });
+}
+
+std::chrono::microseconds APSEthernet::retransmit_timeout(DeviceQueue * queue, const APSCommand_t & command) {
+    if (command.cmd == static_cast<uint32_t>(APS_COMMANDS::EPROMIO)) {
+        return std::chrono::milliseconds(EPROM_TIMEOUT_MS);
+    }
+    return queue->timer.timeout();
+}
+
+APSEthernet::EthernetError APSEthernet::set_retransmit_limits(DeviceHandle handle, double minTimeoutMS, double maxTimeoutMS, unsigned maxRetries) {
+    if (minTimeoutMS <= 0 || maxTimeoutMS < minTimeoutMS) {
+        FILE_LOG(logERROR) << "Invalid retransmit timeout limits " << minTimeoutMS << " - " << maxTimeoutMS << " ms";
+        return INVALID_APS_ID;
+    }
+    DeviceQueue * queue = get_queue(handle);
+    FILE_LOG(logDEBUG1) << "Setting retransmit timeout for " << queue->serial << " to " << minTimeoutMS << " - " << maxTimeoutMS << " ms with " << maxRetries << " retries";
+    queue->timer.set_limits(std::chrono::microseconds(static_cast<int64_t>(1000*minTimeoutMS)),
+        std::chrono::microseconds(static_cast<int64_t>(1000*maxTimeoutMS)), maxRetries);
+    return SUCCESS;
+}
+
+double APSEthernet::get_round_trip_time(DeviceHandle handle) {
+    return get_queue(handle)->timer.round_trip_time().count() / 1000.0;
+}
+
+double APSEthernet::get_retransmit_timeout(DeviceHandle handle) {
+    return get_queue(handle)->timer.timeout().count() / 1000.0;
+}
+
+uint64_t APSEthernet::get_timeout_count(DeviceHandle handle) {
+    return get_queue(handle)->timer.timeoutCount;
+}
+
+uint64_t APSEthernet::get_retransmit_count(DeviceHandle handle) {
+    return get_queue(handle)->timer.retransmitCount;
+}
+
+uint64_t APSEthernet::get_kernel_drops(DeviceHandle handle) {
+    DeviceQueue * queue = get_queue(handle);
+    if (backend_ == PACKET_MMAP_TRANSPORT) {
+        std::lock_guard<std::mutex> guard(ringLock_);
+        if (packetRing_) {
+            return packetRing_->dropped();
+        }
+    }
+    udp::socket & socket = queue->socket ? queue->socket->socket :
+        queue->devInfo.hostInterface ? queue->devInfo.hostInterface->socket : socket_;
+    std::atomic<uint32_t> & kernelDrops = queue->socket ? queue->socket->kernelDrops :
+        queue->devInfo.hostInterface ? queue->devInfo.hostInterface->kernelDrops : sharedDrops_;
+    if (backend_ == ASIO_TRANSPORT) {
+        uint32_t drops;
+        if (!read_socket_drops(socket, drops)) {
+            FILE_LOG(logWARNING) << "Kernel drop counts are not available with the asio transport on this system";
+            return 0;
+        }
+        kernelDrops = drops;
+    }
+    return kernelDrops;
+}
+
+bool SendGate::enter(TrafficClass trafficClass) {
+    std::unique_lock<std::mutex> lock(lock_);
+    if (trafficClass == CONTROL) {
+        controlWaiting_++;
+        free_.wait(lock, [this](){ return !busy_; });
+        controlWaiting_--;
+        busy_ = true;
+        controlSent_ = true;
+        return false;
+    }
+    free_.wait(lock, [this](){ return !busy_ && controlWaiting_ == 0; });
+    busy_ = true;
+    bool controlSent = controlSent_;
+    controlSent_ = false;
+    return controlSent;
+}
+
+void SendGate::leave() {
+    std::lock_guard<std::mutex> lock(lock_);
+    busy_ = false;
+    free_.notify_all();
+}
+
+TransportStats APSEthernet::get_transport_stats(DeviceHandle handle) {
+    DeviceQueue * queue = get_queue(handle);
+    TransportStats stats;
+    queue->counters.snapshot(stats);
+    stats.retransmits = queue->timer.retransmitCount;
+    stats.timeouts = queue->timer.timeoutCount;
+    stats.deviceOverruns = queue->pacer.overrunCount;
+    stats.packetGapNanoseconds = queue->pacer.packet_gap().count();
+    return stats;
+}
+
+APSEthernet::EthernetError APSEthernet::reset_transport_stats(DeviceHandle handle) {
+    DeviceQueue * queue = get_queue(handle);
+    FILE_LOG(logDEBUG1) << "Resetting transport statistics for " << queue->serial;
+    queue->counters.reset();
+    queue->timer.retransmitCount = 0;
+    queue->timer.timeoutCount = 0;
+    queue->pacer.overrunCount = 0;
+    return SUCCESS;
+}
+
+void TransportCounters::add_sent(size_t numPackets, size_t numBytes) {
+    packetsSent_.fetch_add(numPackets, std::memory_order_relaxed);
+    bytesSent_.fetch_add(numBytes, std::memory_order_relaxed);
+}
+
+void TransportCounters::add_received(size_t numBytes) {
+    packetsReceived_.fetch_add(1, std::memory_order_relaxed);
+    bytesReceived_.fetch_add(numBytes, std::memory_order_relaxed);
+}
+
+void TransportCounters::add_round_trip(std::chrono::microseconds rtt) {
+    size_t bucket = std::upper_bound(std::begin(RTT_HISTOGRAM_EDGES_US), std::end(RTT_HISTOGRAM_EDGES_US), static_cast<uint64_t>(rtt.count())) - std::begin(RTT_HISTOGRAM_EDGES_US);
+    rttHistogram_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void TransportCounters::add_upload(size_t numBytes, std::chrono::microseconds duration) {
+    numUploads_.fetch_add(1, std::memory_order_relaxed);
+    uploadBytes_.fetch_add(numBytes, std::memory_order_relaxed);
+    uploadMicroseconds_.fetch_add(duration.count(), std::memory_order_relaxed);
+    lastUploadBytes_.store(numBytes, std::memory_order_relaxed);
+    lastUploadMicroseconds_.store(duration.count(), std::memory_order_relaxed);
+}
+
+uint64_t TransportCounters::packets_sent() const {
+    return packetsSent_.load(std::memory_order_relaxed);
+}
+
+void TransportCounters::raise(std::atomic<uint64_t> & highWater, uint64_t value) {
+    uint64_t current = highWater.load(std::memory_order_relaxed);
+    while (value > current && !highWater.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+}
+
+void TransportCounters::reset() {
+    for (auto counter : {&packetsSent_, &bytesSent_, &packetsReceived_, &bytesReceived_, &numUploads_, &uploadBytes_,
+            &uploadMicroseconds_, &lastUploadBytes_, &lastUploadMicroseconds_, &maxReceiveQueueDepth, &maxPendingRequests, &maxChunksInFlight}) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+    for (auto & bucket : rttHistogram_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+void TransportCounters::snapshot(TransportStats & stats) const {
+    stats.packetsSent = packetsSent_.load(std::memory_order_relaxed);
+    stats.bytesSent = bytesSent_.load(std::memory_order_relaxed);
+    stats.packetsReceived = packetsReceived_.load(std::memory_order_relaxed);
+    stats.bytesReceived = bytesReceived_.load(std::memory_order_relaxed);
+    for (size_t ct = 0; ct < NUM_RTT_BUCKETS; ct++) {
+        stats.rttHistogram[ct] = rttHistogram_[ct].load(std::memory_order_relaxed);
+    }
+    stats.maxReceiveQueueDepth = maxReceiveQueueDepth.load(std::memory_order_relaxed);
+    stats.maxPendingRequests = maxPendingRequests.load(std::memory_order_relaxed);
+    stats.maxChunksInFlight = maxChunksInFlight.load(std::memory_order_relaxed);
+    stats.numUploads = numUploads_.load(std::memory_order_relaxed);
+    stats.uploadBytes = uploadBytes_.load(std::memory_order_relaxed);
+    stats.uploadMicroseconds = uploadMicroseconds_.load(std::memory_order_relaxed);
+    stats.lastUploadBytes = lastUploadBytes_.load(std::memory_order_relaxed);
+    stats.lastUploadMicroseconds = lastUploadMicroseconds_.load(std::memory_order_relaxed);
+}
+
+APSEthernet::EthernetError APSEthernet::set_pacing(DeviceHandle handle, bool adaptive, double packetGapUS) {
+    if (packetGapUS < 0) {
+        FILE_LOG(logERROR) << "Invalid packet gap " << packetGapUS << " us";
+        return INVALID_APS_ID;
+    }
+    DeviceQueue * queue = get_queue(handle);
+    FILE_LOG(logDEBUG1) << (adaptive ? "Enabling" : "Disabling") << " adaptive pacing for " << queue->serial << " with a packet gap of " << packetGapUS << " us";
+    queue->pacer.configure(adaptive, std::chrono::nanoseconds(static_cast<int64_t>(1000*packetGapUS)));
+    return SUCCESS;
+}
+
+PacingController::PacingController() : overrunCount{0}, adaptive_{true}, haveSample_{false}, lastOverruns_{0}, lastPacketsSent_{0},
+    lastSampleAt_{}, sampledAt_{}, packetGap_{0}, windowLimit_{0} {};
+
+bool PacingController::sample_due(bool afterLoss) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastSampleAt_ < std::chrono::milliseconds(afterLoss ? PACING_LOSS_SAMPLE_MS : PACING_SAMPLE_MS)) {
+        return false;
+    }
+    //Counted from the attempt so a device that doesn't answer isn't asked again straight away
+    lastSampleAt_ = now;
+    return true;
+}
+
+bool PacingController::add_sample(uint32_t overruns, uint64_t packetsSent, unsigned ackWindow) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = std::chrono::steady_clock::now();
+    //The counters wrap; one that went backwards a long way was most likely reset along with the device
+    uint32_t newOverruns = overruns - lastOverruns_;
+    if (!haveSample_ || newOverruns > (1u << 31)) {
+        newOverruns = 0;
+    }
+    //Packets the device took in since the last sample, and over how long. Resetting our statistics also makes the
+    //sent count go backwards.
+    uint64_t sentSince = packetsSent >= lastPacketsSent_ ? packetsSent - lastPacketsSent_ : 0;
+    auto interval = now - sampledAt_;
+    haveSample_ = true;
+    lastOverruns_ = overruns;
+    lastPacketsSent_ = packetsSent;
+    sampledAt_ = now;
+    overrunCount += newOverruns;
+    if (!adaptive_) {
+        return newOverruns > 0;
+    }
+    unsigned window = windowLimit_ ? std::min(windowLimit_, ackWindow) : ackWindow;
+    if (newOverruns) {
+        //Back off hard: at least double the gap, or go straight to the rate the device managed to keep up with, and
+        //halve the window
+        auto sustainedGap = std::chrono::nanoseconds(0);
+        if (sentSince > newOverruns) {
+            sustainedGap = std::chrono::duration_cast<std::chrono::nanoseconds>(interval) / static_cast<int64_t>(sentSince - newOverruns);
+        }
+        packetGap_ = std::max(std::max(2 * packetGap_, sustainedGap), std::chrono::nanoseconds(MIN_PACKET_GAP_NS));
+        packetGap_ = std::min(packetGap_, std::chrono::nanoseconds(MAX_PACKET_GAP_NS));
+        windowLimit_ = std::max(window / 2, 1u);
+        return true;
+    }
+    //Recover gently: first close the gap, then open the window back up a chunk at a time
+    if (packetGap_.count()) {
+        packetGap_ = packetGap_ * 7 / 8;
+        if (packetGap_ < std::chrono::nanoseconds(MIN_PACKET_GAP_NS)) {
+            packetGap_ = std::chrono::nanoseconds(0);
+        }
+    } else if (windowLimit_) {
+        windowLimit_ = window + 1 < ackWindow ? window + 1 : 0;
+    }
+    return false;
+}
+
+std::chrono::nanoseconds PacingController::packet_gap() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return packetGap_;
+}
+
+unsigned PacingController::window(unsigned ackWindow) const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return windowLimit_ ? std::min(windowLimit_, ackWindow) : ackWindow;
+}
+
+void PacingController::configure(bool adaptive, std::chrono::nanoseconds packetGap) {
+    std::lock_guard<std::mutex> guard(lock_);
+    adaptive_ = adaptive;
+    packetGap_ = packetGap;
+    windowLimit_ = 0;
+}
+
+RetransmitTimer::RetransmitTimer() : timeoutCount{0}, retransmitCount{0}, srtt_{0}, rttvar_{0}, haveSample_{false}, backoffShift_{0},
+    minTimeout_{std::chrono::milliseconds(DEFAULT_MIN_RETRANSMIT_MS)}, maxTimeout_{std::chrono::milliseconds(DEFAULT_MAX_RETRANSMIT_MS)},
+    maxRetries_{DEFAULT_MAX_RETRIES} {};
+
+void RetransmitTimer::add_sample(std::chrono::microseconds rtt) {
+    std::lock_guard<std::mutex> guard(lock_);
+    double sample = rtt.count();
+    if (!haveSample_) {
+        srtt_ = sample;
+        rttvar_ = sample / 2;
+        haveSample_ = true;
+    } else {
+        //RFC 6298 gains: beta = 1/4 for the deviation, alpha = 1/8 for the mean
+        rttvar_ += (std::abs(srtt_ - sample) - rttvar_) / 4;
+        srtt_ += (sample - srtt_) / 8;
+    }
+    backoffShift_ = 0;
+}
+
+void RetransmitTimer::backoff() {
+    std::lock_guard<std::mutex> guard(lock_);
+    //Past this the timeout is pinned at the maximum anyway
+    if (backoffShift_ < 16) {
+        backoffShift_++;
+    }
+}
+
+void RetransmitTimer::reset_backoff() {
+    std::lock_guard<std::mutex> guard(lock_);
+    backoffShift_ = 0;
+}
+
+std::chrono::microseconds RetransmitTimer::timeout() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    std::chrono::microseconds rto = haveSample_ ?
+        std::chrono::microseconds(static_cast<int64_t>(srtt_ + 4*rttvar_)) :
+        std::chrono::milliseconds(INITIAL_RETRANSMIT_MS);
+    rto = std::max(rto, minTimeout_) * (1 << backoffShift_);
+    return std::min(rto, maxTimeout_);
+}
+
+std::chrono::microseconds RetransmitTimer::max_timeout() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return maxTimeout_;
+}
+
+std::chrono::microseconds RetransmitTimer::round_trip_time() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return std::chrono::microseconds(static_cast<int64_t>(srtt_));
+}
+
+void RetransmitTimer::set_limits(std::chrono::microseconds minTimeout, std::chrono::microseconds maxTimeout, unsigned maxRetries) {
+    std::lock_guard<std::mutex> guard(lock_);
+    minTimeout_ = minTimeout;
+    maxTimeout_ = maxTimeout;
+    maxRetries_ = maxRetries;
+}
@@ -4,15 +4,405 @@
 #include "headings.h"
 #include "MACAddr.h"
 #include "APSEthernetPacket.h"
+#include "SPSCQueue.h"
+#include "PacketRing.h"
 
 #include "asio.hpp"
 
+//Linux lets us move a whole batch of datagrams per system call, and delivers datagrams to a connected socket ahead of
+//an unconnected one bound to the same port so each device can have its own socket. It also lets us list the host's
+//interfaces and tie a socket to one of them. PacketRing.h says whether packet rings are available.
+#ifdef __linux__
+#define HAVE_SENDMMSG
+#define HAVE_DEVICE_SOCKETS
+#define HAVE_INTERFACE_SOCKETS
+#endif
+
 using asio::ip::udp;
 
+//Index of a connected device in the driver's device table; see APSEthernet::connect
+typedef int DeviceHandle;
+//What connect and find_handle give back when there is no device to hand out
+static const DeviceHandle INVALID_DEVICE_HANDLE = -1;
+
+//Default number of acknowledged chunks allowed in flight during a bulk transfer, and of packets in each chunk
+static const unsigned DEFAULT_ACK_WINDOW = 8;
+static const unsigned DEFAULT_ACK_EVERY = 20;
+
+//Default number of payload words per packet for bulk transfers; the protocol allows up to APSEthernetPacket::MAX_PAYLOAD_WORDS
+static const size_t DEFAULT_MAX_PAYLOAD = 256;
+
+//Maximum number of datagrams handed to the kernel per sendmmsg/recvmmsg call
+static const size_t MAX_SEND_BATCH = 64;
+static const size_t MAX_RECV_BATCH = 32;
+
+//Most devices we can connect to at once and how many unread packets each may hold
+static const size_t MAX_CONNECTED_DEVICES = 64;
+static const size_t DEVICE_QUEUE_DEPTH = 1024;
+
+//Most host interfaces the driver will open sockets on; see APSEthernet::set_interfaces
+static const size_t MAX_HOST_INTERFACES = 16;
+
+//Most queries a device may have waiting on a reply at once
+static const size_t MAX_OUTSTANDING_REQUESTS = 16;
+
+//Threads that run asynchronous device operations; shared by all devices. Queries give their thread back while they
+//wait on the device, but a job that blocks, like a bulk upload, keeps it, so at most this many of those run at once.
+static const size_t NUM_ASYNC_WORKERS = 4;
+
+//Enumerate repeats its broadcast a few times in case one is lost and by default listens for answers for a second
+static const unsigned ENUMERATE_BROADCASTS = 3;
+static const unsigned ENUMERATE_RETRY_MS = 100;
+static const unsigned DEFAULT_ENUMERATE_TIMEOUT_MS = 1000;
+
+//Receive buffer requested in low-latency mode so bursts aren't dropped while the receive thread is busy; a larger size
+//set with set_socket_buffers wins
+static const int LOW_LATENCY_RCVBUF = 4 << 20;
+
+//How long the packet ring's receive thread sleeps before checking whether it should stop
+static const int RING_POLL_MS = 100;
+
+//Retransmission timeout defaults. EPROM operations wait on the flash rather than the network so they use a fixed timeout.
+static const unsigned DEFAULT_MIN_RETRANSMIT_MS = 2;
+static const unsigned DEFAULT_MAX_RETRANSMIT_MS = 2000;
+static const unsigned DEFAULT_MAX_RETRIES = 10;
+static const unsigned INITIAL_RETRANSMIT_MS = 100;
+static const unsigned EPROM_TIMEOUT_MS = 10000;
+
+//Adaptive pacing of bulk uploads: how often an upload samples the device's overrun counters and how soon after the
+//last sample a lost packet may prompt another
+static const unsigned PACING_SAMPLE_MS = 20;
+static const unsigned PACING_LOSS_SAMPLE_MS = 2;
+//How long the driver waits on the status bank when it reads it for itself
+static const unsigned STATUS_QUERY_TIMEOUT_MS = 100;
+//The status read that checks a streamed upload may queue behind the whole upload, so it gets longer
+static const unsigned STREAM_VERIFY_TIMEOUT_MS = 1000;
+//Smallest gap put between packets once the device overruns, and the most it backs off to
+static const unsigned MIN_PACKET_GAP_NS = 1000;
+static const unsigned MAX_PACKET_GAP_NS = 1000000;
+
+//Round trip time estimate for one device (Jacobson/Karels) and the retransmission timeout derived from it
+class RetransmitTimer {
+public:
+	RetransmitTimer();
+
+	//Feed in the round trip of a packet that was only sent once (Karn's algorithm)
+	void add_sample(std::chrono::microseconds);
+	//Double the timeout after it expires; it drops back once the device acknowledges something
+	void backoff();
+	void reset_backoff();
+	std::chrono::microseconds timeout() const;
+	//The ceiling backoff stops at
+	std::chrono::microseconds max_timeout() const;
+	std::chrono::microseconds round_trip_time() const;
+
+	void set_limits(std::chrono::microseconds, std::chrono::microseconds, unsigned);
+	unsigned max_retries() const { return maxRetries_; };
+
+	//How often the timeout expired and how many packets were sent again as a result
+	std::atomic<uint64_t> timeoutCount;
+	std::atomic<uint64_t> retransmitCount;
+
+private:
+	mutable std::mutex lock_;
+	double srtt_;
+	double rttvar_;
+	bool haveSample_;
+	unsigned backoffShift_;
+	std::chrono::microseconds minTimeout_;
+	std::chrono::microseconds maxTimeout_;
+	std::atomic<unsigned> maxRetries_;
+};
+
+//Paces bulk uploads to what one device can take in. The APS2 counts the packets it had to throw away because they
+//arrived faster than it could absorb them (the FCS and packet overrun counters in its status bank). Each sample of
+//those counters adjusts the gap put between packets and a limit on the acknowledge window: both back off sharply when
+//the counts rise and creep back towards full speed while they don't.
+class PacingController {
+public:
+	PacingController();
+
+	//Whether an upload should sample the overrun counters now, which is sooner after a lost packet. A yes restarts
+	//the interval to the next sample.
+	bool sample_due(bool afterLoss);
+	//Feed in the device's combined overrun count, the packets we have sent it and the configured window. The first
+	//sample only sets the baseline. Returns whether the overrun count rose since the last one.
+	bool add_sample(uint32_t overruns, uint64_t packetsSent, unsigned ackWindow);
+
+	std::chrono::nanoseconds packet_gap() const;
+	//The window to use given the configured one
+	unsigned window(unsigned ackWindow) const;
+
+	//Disabled, the gap stays where it is set and the window is not limited
+	void configure(bool adaptive, std::chrono::nanoseconds packetGap);
+	bool adaptive() const { return adaptive_; };
+
+	//Overruns seen since the device was connected or its statistics were reset
+	std::atomic<uint64_t> overrunCount;
+
+private:
+	mutable std::mutex lock_;
+	std::atomic<bool> adaptive_;
+	bool haveSample_;
+	uint32_t lastOverruns_;
+	uint64_t lastPacketsSent_;
+	//When a sample was last asked for and when the last one came in
+	std::chrono::steady_clock::time_point lastSampleAt_;
+	std::chrono::steady_clock::time_point sampledAt_;
+	std::chrono::nanoseconds packetGap_;
+	//Zero when the window is not limited
+	unsigned windowLimit_;
+};
+
+//Upper edges in microseconds of the acknowledgement round trip histogram; the last bucket catches everything slower
+static const unsigned RTT_HISTOGRAM_EDGES_US[] = {50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000};
+static const size_t NUM_RTT_BUCKETS = sizeof(RTT_HISTOGRAM_EDGES_US) / sizeof(RTT_HISTOGRAM_EDGES_US[0]) + 1;
+
+//Snapshot of a device's transport statistics; see APSEthernet::get_transport_stats
+struct TransportStats {
+	uint64_t packetsSent;
+	uint64_t bytesSent;
+	uint64_t packetsReceived;
+	uint64_t bytesReceived;
+	uint64_t retransmits;
+	uint64_t timeouts;
+	uint64_t rttHistogram[NUM_RTT_BUCKETS];
+	//High-water marks of the receive queue, the outstanding queries and the chunks of a bulk transfer in flight
+	uint64_t maxReceiveQueueDepth;
+	uint64_t maxPendingRequests;
+	uint64_t maxChunksInFlight;
+	//Bulk uploads: how many, their total payload and time, and the payload and time of the latest
+	uint64_t numUploads;
+	uint64_t uploadBytes;
+	uint64_t uploadMicroseconds;
+	uint64_t lastUploadBytes;
+	uint64_t lastUploadMicroseconds;
+	//Packets the device reported dropping because we sent too fast, and the gap currently put between packets
+	uint64_t deviceOverruns;
+	uint64_t packetGapNanoseconds;
+};
+
+//Running totals behind TransportStats. They are bumped from whichever thread sees the event and only ever read as a
+//snapshot, so relaxed atomics are enough.
+class TransportCounters {
+public:
+	TransportCounters() { reset(); };
+
+	void add_sent(size_t numPackets, size_t numBytes);
+	void add_received(size_t numBytes);
+	void add_round_trip(std::chrono::microseconds);
+	void add_upload(size_t numBytes, std::chrono::microseconds);
+	static void raise(std::atomic<uint64_t> &, uint64_t);
+	uint64_t packets_sent() const;
+
+	void reset();
+	void snapshot(TransportStats &) const;
+
+	std::atomic<uint64_t> maxReceiveQueueDepth;
+	std::atomic<uint64_t> maxPendingRequests;
+	std::atomic<uint64_t> maxChunksInFlight;
+
+private:
+	std::atomic<uint64_t> packetsSent_;
+	std::atomic<uint64_t> bytesSent_;
+	std::atomic<uint64_t> packetsReceived_;
+	std::atomic<uint64_t> bytesReceived_;
+	std::atomic<uint64_t> rttHistogram_[NUM_RTT_BUCKETS];
+	std::atomic<uint64_t> numUploads_;
+	std::atomic<uint64_t> uploadBytes_;
+	std::atomic<uint64_t> uploadMicroseconds_;
+	std::atomic<uint64_t> lastUploadBytes_;
+	std::atomic<uint64_t> lastUploadMicroseconds_;
+};
+
+//Reusable storage for one serialized packet
+struct alignas(16) WireBuffer {
+	uint8_t data[APSEthernetPacket::MAX_NUM_BYTES];
+};
+
+//A chunk of a windowed transfer as [first, last) packet indices
+struct InFlightChunk {
+	size_t first;
+	size_t last;
+	bool acked;
+	bool retransmitted;
+	//A single lost packet resent with its own acknowledge request
+	bool repair;
+	//Went out straight after a resend so the APS2 sees a jump in sequence numbers at its first packet
+	bool afterResend;
+	//Final packet was resent after later packets had gone out so the APS2 sees a jump there too
+	bool reordered;
+	std::chrono::steady_clock::time_point sentAt;
+};
+
+//A socket bound to the address of one host interface, used to enumerate and talk to the devices on that interface's
+//subnet when a rack is spread across several ports. It stays open until the driver shuts down and is served by the
+//shared receive thread.
+struct InterfaceSocket {
+	InterfaceSocket(asio::io_service & ios, const string & name, const asio::ip::address_v4 & address, const asio::ip::address_v4 & netmask) :
+		name{name}, address{address}, netmask{netmask}, active{true}, socket(ios) {};
+
+	const string name;
+	const asio::ip::address_v4 address;
+	const asio::ip::address_v4 netmask;
+	//Cleared when set_interfaces no longer lists the interface
+	std::atomic<bool> active;
+	udp::socket socket;
+	udp::endpoint senderEndpoint;
+	uint8_t receivedData[MAX_RECV_BATCH][2048];
+
+	//Datagrams the kernel dropped because the socket's receive buffer was full, as last reported by SO_RXQ_OVFL
+	std::atomic<uint32_t> kernelDrops{0};
+
+	bool on_subnet(uint32_t ipAddr) const { return (ipAddr & netmask.to_ulong()) == (address.to_ulong() & netmask.to_ulong()); };
+	asio::ip::address_v4 broadcast() const { return asio::ip::address_v4::broadcast(address, netmask); };
+};
+
 struct EthernetDevInfo {
 	MACAddr macAddr;
 	udp::endpoint endpoint;
+	//The host interface traffic to the device goes through when using several; null for the shared socket
+	InterfaceSocket * hostInterface = nullptr;
+	uint16_t seqNum = 0;
+	unsigned ackWindow = DEFAULT_ACK_WINDOW;
+	unsigned ackEvery = DEFAULT_ACK_EVERY;
+	size_t maxPayload = DEFAULT_MAX_PAYLOAD;
+	//Send bulk uploads unacknowledged and check delivery afterwards; see APSEthernet::set_streaming
+	bool streaming = false;
+	//Packets are serialized here before going out on the wire so sends don't touch the heap
+	vector<WireBuffer> sendBuffers;
+};
+
+//Bulk transfer settings found to work best for one device, see APS2::calibrate_transport
+struct TransportProfile {
+	size_t maxPayload;
+	unsigned ackEvery;
+	unsigned ackWindow;
+};
+
+//A query sent with APSEthernet::async_query while it is outstanding
+struct AsyncQuery;
+
+//A query waiting on its reply; replies are matched on the echoed sequence number and the command
+struct PendingRequest {
+	bool active = false;
+	//Atomic so a spinning reader can watch it without taking the lock
+	std::atomic<bool> answered{false};
 	uint16_t seqNum;
+	uint32_t command;
+	bool retransmitted;
+	std::chrono::steady_clock::time_point sentAt;
+	std::chrono::steady_clock::time_point answeredAt;
+	APSEthernetPacket reply;
+	//Set for an asynchronous query; nobody waits on those, so the reply is handed straight to their handler
+	std::shared_ptr<AsyncQuery> async;
+};
+
+//A job for the asynchronous workers. It is handed a function to call once it has finished, which it may call later from
+//another worker, e.g. from the handler of a query it sent.
+typedef std::function<void(std::function<void()>)> AsyncJob;
+
+//Lets one sender at a time put a device's packets on the wire, so sequence numbers reach the APS2 in the order they
+//were taken. Control traffic (queries and single commands) goes ahead of bulk transfers, which only get the gate
+//when no control packet is waiting for it.
+class SendGate {
+public:
+	enum TrafficClass { CONTROL, BULK };
+
+	SendGate() : busy_{false}, controlWaiting_{0}, controlSent_{false} {};
+
+	//Blocks until the gate is ours. Entering for bulk traffic returns whether control packets went out since the last
+	//bulk send; if one of those was lost or resent the APS2 sees a jump in sequence numbers at the next bulk packet.
+	bool enter(TrafficClass);
+	void leave();
+
+	//Holds the gate for a scope
+	class Guard {
+	public:
+		Guard(SendGate & gate, TrafficClass trafficClass) : gate_(gate), controlSent_{gate.enter(trafficClass)} {};
+		~Guard() { gate_.leave(); };
+		bool control_sent() const { return controlSent_; };
+	private:
+		SendGate & gate_;
+		bool controlSent_;
+	};
+
+private:
+	std::mutex lock_;
+	std::condition_variable free_;
+	bool busy_;
+	unsigned controlWaiting_;
+	bool controlSent_;
+};
+
+//A socket connected to a single device so the kernel sorts its datagrams out for us. It is served either by the shared
+//receive thread or, with dedicated I/O threads, by its own io_service and thread.
+struct DeviceSocket {
+	DeviceSocket(asio::io_service * ownIos, asio::io_service & sharedIos) : ios{ownIos}, socket(ownIos ? *ownIos : sharedIos) {};
+
+	std::unique_ptr<asio::io_service> ios;
+	udp::socket socket;
+	std::thread thread;
+	udp::endpoint senderEndpoint;
+	uint8_t receivedData[MAX_RECV_BATCH][2048];
+
+	//Datagrams the kernel dropped because the socket's receive buffer was full, as last reported by SO_RXQ_OVFL
+	std::atomic<uint32_t> kernelDrops{0};
+};
+
+//Entry in the device table. The receive thread is the only producer and the device's reader the only
+//consumer, so packets are handed over through a lock-free ring; the mutex and condition variable are only touched
+//when the reader has to sleep.
+struct DeviceQueue {
+	DeviceQueue(DeviceHandle handle, uint32_t ipAddr) : handle{handle}, ipAddr{ipAddr}, serial{asio::ip::address_v4(ipAddr).to_string()},
+		connected{false}, packets(DEVICE_QUEUE_DEPTH), waiting{false}, numPending{0} {};
+
+	const DeviceHandle handle;
+	const uint32_t ipAddr;
+	const string serial;
+	std::atomic<bool> connected;
+	SPSCQueue<APSEthernetPacket> packets;
+
+	std::atomic<bool> waiting;
+	std::mutex waitLock;
+	std::condition_variable packetArrived;
+
+	//Parse target for when the ring is full so replies to queries still get through
+	APSEthernetPacket overflowPacket;
+
+	//Serializes readers so the ring keeps a single consumer
+	std::mutex readLock;
+	//Uploads read their acknowledges off the ring over the whole transfer, so only one runs against a device at a time
+	std::mutex uploadLock;
+
+	//Outstanding queries. Replies that match one are handed straight to it; everything else goes through the ring.
+	std::array<PendingRequest, MAX_OUTSTANDING_REQUESTS> pending;
+	std::atomic<size_t> numPending;
+	std::mutex pendingLock;
+	std::condition_variable replyArrived;
+	//Asynchronous queries waiting for a free slot; they are sent as slots are released
+	std::deque<std::shared_ptr<AsyncQuery>> waitingQueries;
+
+	//Orders sends and puts control traffic ahead of bulk transfers
+	SendGate gate;
+
+	//Kept with the queue rather than the device info so the estimate and limits survive a re-enumerate
+	RetransmitTimer timer;
+	PacingController pacer;
+	TransportCounters counters;
+
+	//The device's own socket, if it was connected with per-device sockets; it stays open until the driver shuts down
+	std::unique_ptr<DeviceSocket> socket;
+
+	//Addressing, sequence numbering and transfer settings. Like the queue these outlive a re-enumerate.
+	EthernetDevInfo devInfo;
+
+	//Asynchronous jobs in the order they were posted. The one at the front is running; see APSEthernet::post_async.
+	std::mutex jobLock;
+	std::deque<AsyncJob> jobs;
+
+	//Ethernet address frames from the device came from, learned by the packet ring; zero until we have heard from it
+	std::atomic<uint64_t> linkAddr{0};
 };
 
 class APSEthernet {
@@ -25,7 +415,14 @@ public:
 		INVALID_PCAP_FILTER = -3,
 		INVALID_APS_ID = -4,
 		TIMEOUT = -5,
-		INVALID_SPI_TARGET
+		INVALID_SPI_TARGET = -6
+	};
+
+	//How datagrams are moved between the socket and the driver
+	enum TransportBackend {
+		ASIO_TRANSPORT = 0, // one asio send_to/async_receive_from per datagram
+		MMSG_TRANSPORT = 1, // batched sendmmsg/recvmmsg (Linux only)
+		PACKET_MMAP_TRANSPORT = 2 // AF_PACKET socket with memory mapped rings (Linux only, needs CAP_NET_RAW)
 	};
 
 	//APSEthernet is a singleton instance for the driver
@@ -37,12 +434,118 @@ public:
 
 	~APSEthernet();
 	EthernetError init();
-	set<string> enumerate();
-	EthernetError connect(string serial);
-	EthernetError disconnect(string serial);
-	EthernetError send(string serial, APSEthernetPacket msg, bool checkResponse=true);
-	EthernetError send(string serial, vector<APSEthernetPacket> msg, unsigned ackEvery=1);
-	vector<APSEthernetPacket> receive(string serial, size_t numPackets = 1, size_t timeoutMS = 10000);
+	//Broadcast for devices and collect their addresses. Returns as soon as expectedDevices devices and every MAC
+	//address in expectedMACs have answered, or once timeoutMS has passed.
+	set<string> enumerate(size_t expectedDevices = 0, const vector<MACAddr> & expectedMACs = vector<MACAddr>(),
+		size_t timeoutMS = DEFAULT_ENUMERATE_TIMEOUT_MS);
+	//Connecting gives a handle into the device table which the per-device calls below take, so they don't need to
+	//look the device up by name. A device keeps its handle across disconnects and re-enumerates. Returns
+	//INVALID_DEVICE_HANDLE if the address is bad or the table is full.
+	DeviceHandle connect(string serial);
+	EthernetError disconnect(DeviceHandle handle);
+	//The handle for a device, connecting to it if need be; throws if that fails
+	DeviceHandle get_handle(string serial);
+	//The handle of a device already in the table, connected or not, or INVALID_DEVICE_HANDLE. Never opens anything, so
+	//settings and statistics can be looked at without connecting.
+	DeviceHandle find_handle(const string & serial);
+	bool is_connected(DeviceHandle handle);
+
+	EthernetError send(DeviceHandle handle, APSEthernetPacket msg, bool checkResponse=true);
+	//A transfer that fits in one packet counts as control traffic; anything longer is bulk and lets queries and other
+	//short operations go out between its windows
+	EthernetError send(DeviceHandle handle, vector<APSEthernetPacket> msg, unsigned ackEvery=1);
+	vector<APSEthernetPacket> receive(DeviceHandle handle, size_t numPackets = 1, size_t timeoutMS = 10000);
+	EthernetError receive(DeviceHandle handle, APSEthernetPacket & packet, size_t timeoutMS = 10000);
+
+	//Request/reply correlation: send_request stamps the request with a fresh sequence number that receive_reply
+	//then uses to pick out its reply, so several queries can be outstanding against one device
+	EthernetError send_request(DeviceHandle handle, APSEthernetPacket & request);
+	EthernetError receive_reply(DeviceHandle handle, const APSEthernetPacket & request, APSEthernetPacket & reply, size_t timeoutMS = 10000);
+	EthernetError query(DeviceHandle handle, APSEthernetPacket request, APSEthernetPacket & reply, size_t timeoutMS = 10000);
+
+	//Send a query without waiting for it. The handler runs on an asynchronous worker with SUCCESS and the reply, or with
+	//TIMEOUT once the retries have run out. Resends are driven by a timer, so no thread is tied up in the meantime.
+	typedef std::function<void(EthernetError, const APSEthernetPacket &)> ReplyHandler;
+	void async_query(DeviceHandle handle, APSEthernetPacket request, ReplyHandler handler);
+
+	//Retransmission timing
+	EthernetError set_retransmit_limits(DeviceHandle handle, double minTimeoutMS, double maxTimeoutMS, unsigned maxRetries);
+	double get_round_trip_time(DeviceHandle handle);
+	double get_retransmit_timeout(DeviceHandle handle);
+	uint64_t get_timeout_count(DeviceHandle handle);
+	uint64_t get_retransmit_count(DeviceHandle handle);
+	//Datagrams the kernel dropped for want of receive buffer on the path the device's replies take. That is the
+	//device's own socket if it has one, otherwise the socket of its host interface or the shared socket (and so counts
+	//drops for every device on it), or the receive ring while the packet ring backend is in use.
+	uint64_t get_kernel_drops(DeviceHandle handle);
+
+	//Traffic counters, round trip histogram, queue high-water marks and upload throughput, since the device was first
+	//connected or the last reset. Resetting also zeroes the timeout and retransmit counts.
+	TransportStats get_transport_stats(DeviceHandle handle);
+	EthernetError reset_transport_stats(DeviceHandle handle);
+
+	EthernetError set_ack_window(DeviceHandle handle, unsigned window);
+	unsigned get_ack_window(DeviceHandle handle);
+
+	//Adaptive pacing samples the device's overrun counters during bulk uploads and slows down to match. packetGapUS is
+	//where the gap between packets starts, or where it stays with adaptive pacing off.
+	EthernetError set_pacing(DeviceHandle handle, bool adaptive, double packetGapUS);
+
+	//Streaming sends memory and bitfile uploads without acknowledges and checks they all arrived from the device's
+	//status counters once at the end, only falling back to acknowledged resends for what went missing
+	EthernetError set_streaming(DeviceHandle handle, bool enable);
+	bool get_streaming(DeviceHandle handle);
+
+	//Packets per acknowledged chunk for bulk uploads
+	EthernetError set_ack_every(DeviceHandle handle, unsigned numPackets);
+	unsigned get_ack_every(DeviceHandle handle);
+
+	EthernetError set_max_payload(DeviceHandle handle, size_t numWords);
+	size_t get_max_payload(DeviceHandle handle);
+	//The largest payload that fits in one frame on the route to the device, or the protocol limit if the MTU can't be
+	//found out. The packet ring never fragments, so anything larger is dropped without a word.
+	size_t get_path_max_payload(DeviceHandle handle);
+
+	//Apply a device's payload, chunk and window settings together and remember them against its MAC address, so they
+	//are applied again whenever a device with that address is connected. Profiles can be kept in a file between runs;
+	//loading applies them to devices already connected too. Both return false if the file can't be used.
+	EthernetError set_transport_profile(DeviceHandle handle, const TransportProfile & profile);
+	bool save_transport_profiles(const string & fileName);
+	bool load_transport_profiles(const string & fileName);
+
+	//The packet ring backend opens its rings on interface, or on the first interface that is up if it is empty. Best
+	//chosen before init() so the enumerate replies already come through the ring.
+	EthernetError set_transport(TransportBackend backend, const string & interface = "");
+	TransportBackend get_transport() const;
+
+	//Open a connected socket for each device connected from now on. With dedicatedThreads each device socket gets its
+	//own I/O thread, pinned to core firstCore + n for the nth device when firstCore is not negative.
+	EthernetError set_device_sockets(bool enable, bool dedicatedThreads = false, int firstCore = -1);
+
+	//Spread devices across several host interfaces. Each interface, or every one that is up with an IPv4 address when
+	//interfaces is empty, gets its own socket. Enumerate then broadcasts on each of them and a device is tied to the
+	//interface whose subnet it is on, so its traffic, and its own socket if it has one, go through that port. The
+	//packet ring backend only serves a single interface so the two can't be used together. Like device sockets this
+	//applies to devices as they are connected.
+	EthernetError set_interfaces(bool enable, const vector<string> & interfaces = vector<string>());
+
+	//Trade CPU for latency: the receive threads busy-poll their sockets and readers spin on their reply rather
+	//than sleeping. busyPollUS sets SO_BUSY_POLL on every socket when not zero, including device and interface sockets
+	//opened later. The receive thread is pinned to receiveCore when it is not negative.
+	EthernetError set_low_latency(bool enable, int receiveCore = -1, unsigned busyPollUS = 0);
+	bool get_low_latency() const;
+
+	//Request SO_RCVBUF and SO_SNDBUF sizes in bytes for the shared socket, every interface socket and every device
+	//socket; zero leaves a size alone. The kernel caps requests at net.core.rmem_max/wmem_max unless we have
+	//CAP_NET_ADMIN.
+	EthernetError set_socket_buffers(int receiveBytes, int sendBytes);
+
+	//Queue a job on the asynchronous workers. Jobs for the same device run one at a time in the order posted, each
+	//starting once the one before has finished; jobs for different devices share the NUM_ASYNC_WORKERS workers. post's
+	//job has finished when it returns, while one from post_async may hand back its worker and finish later, e.g. from
+	//the handler of an async_query.
+	void post(DeviceHandle handle, std::function<void()> job);
+	void post_async(DeviceHandle handle, AsyncJob job);
 
 private:
 	APSEthernet();
@@ -50,27 +553,108 @@ private:
 
 	MACAddr srcMAC_;
 
-	//Keep track of all the device info with a map from I.P. addresses to devInfo structs
+	//Devices that answered the last enumerate, keyed by I.P. address. The receive thread adds to it under
+	//enumerateLock_ and signals deviceFound_.
 	unordered_map<string, EthernetDevInfo> devInfo_;
+	std::mutex enumerateLock_;
+	std::condition_variable deviceFound_;
+
+	//The device table, indexed by handle. Slots are only ever appended (and reused on reconnect) so the receive
+	//thread can scan the first numDeviceQueues_ entries without taking a lock.
+	std::unique_ptr<DeviceQueue> deviceQueues_[MAX_CONNECTED_DEVICES];
+	std::atomic<size_t> numDeviceQueues_;
+	unordered_map<string, DeviceHandle> handles_;
+
+	//Transport profiles by MAC address, guarded by mLock_
+	unordered_map<MACAddr, TransportProfile> profiles_;
+	void apply_profile(DeviceQueue *, const TransportProfile &);
 
-	unordered_map<string, queue<APSEthernetPacket>> msgQueues_;
+	DeviceQueue * get_queue(DeviceHandle);
+	bool pop_packet(DeviceQueue *, APSEthernetPacket &, const std::chrono::steady_clock::time_point &);
 
 	void reset_maps();
 
-	void setup_receive();
-	void sort_packet(const vector<uint8_t> &, const udp::endpoint &);
+	void receive_loop(asio::io_service &);
+	void setup_receive(udp::socket &, uint8_t (*)[2048], udp::endpoint &, std::atomic<uint32_t> &, DeviceQueue *);
+	void receive_batch(udp::socket &, uint8_t (*)[2048], std::atomic<uint32_t> &, DeviceQueue *);
+	void dispatch_packet(DeviceQueue *, const uint8_t *, size_t, const udp::endpoint &);
+	void sort_packet(const uint8_t *, size_t, const udp::endpoint &);
+	void queue_packet(DeviceQueue *, const uint8_t *, size_t);
+	void open_device_socket(DeviceQueue *, size_t, const asio::ip::address_v4 &);
+	bool open_interface_socket(const string &, const asio::ip::address_v4 &, const asio::ip::address_v4 &);
+	InterfaceSocket * find_interface(uint32_t);
+	void ring_loop();
+	void learn_link_addr(uint32_t, uint64_t);
+	void close_ring();
+	void wait_for_receivers();
+	void drop_socket_datagrams(bool);
+	void apply_socket_buffers(udp::socket &);
+	void apply_low_latency(udp::socket &);
+	bool deliver_reply(DeviceQueue *, const APSEthernetPacket &);
+	void issue_request(DeviceQueue *, APSEthernetPacket &, std::shared_ptr<AsyncQuery>);
+	void release_request(DeviceQueue *, PendingRequest &);
+	void issue_async(std::shared_ptr<AsyncQuery>);
+	void async_timeout(std::shared_ptr<AsyncQuery>);
+	void run_next_job(DeviceQueue *);
+	std::chrono::microseconds retransmit_timeout(DeviceQueue *, const APSCommand_t &);
 
-	EthernetError send_chunk(string, vector<APSEthernetPacket>, bool);
+	void send_chunk(DeviceQueue *, const APSEthernetPacket *, size_t);
+	void send_paced(DeviceQueue *, const APSEthernetPacket *, size_t, std::chrono::nanoseconds, std::chrono::steady_clock::time_point &);
+	void send_packet(DeviceQueue *, const udp::endpoint &, const APSEthernetPacket &);
+	void send_batch(DeviceQueue *, const udp::endpoint &, const WireBuffer *, const size_t *, size_t);
+	bool send_ring(DeviceQueue *, const APSEthernetPacket *, size_t);
+	EthernetError send_control(DeviceQueue *, APSEthernetPacket &);
+	EthernetError send_windowed(DeviceQueue *, APSEthernetPacket *, size_t, unsigned, SendGate::TrafficClass);
+	void take_seqnums(DeviceQueue *, APSEthernetPacket *, size_t);
+	EthernetError send_streamed(DeviceQueue *, APSEthernetPacket *, size_t, unsigned);
+	bool read_status(DeviceQueue *, APSStatusBank_t &, APSEthernetPacket &, unsigned timeoutMS = STATUS_QUERY_TIMEOUT_MS);
+	void sample_overruns(DeviceQueue *, const APSStatusBank_t &);
 
 	asio::io_service ios_;
 	udp::socket socket_;
 
-	// storage for received packets
- 	uint8_t receivedData_[2048];
+	std::atomic<TransportBackend> backend_;
+
+	// storage for received packets; the asio backend only uses the first slot
+ 	uint8_t receivedData_[MAX_RECV_BATCH][2048];
 	udp::endpoint senderEndpoint_;
+	//Kernel drops on the shared socket; see DeviceSocket::kernelDrops
+	std::atomic<uint32_t> sharedDrops_;
+
+	//Requested socket buffer sizes; see set_socket_buffers
+	int receiveBufferBytes_;
+	int sendBufferBytes_;
+
+	//Per-device socket settings, applied at connect
+	bool deviceSockets_;
+	bool dedicatedThreads_;
+	int firstCore_;
+
+	//Host interface sockets; see set_interfaces. Slots are only ever appended and changes take both mLock_ and
+	//enumerateLock_, so either is enough to look at them.
+	std::unique_ptr<InterfaceSocket> interfaces_[MAX_HOST_INTERFACES];
+	size_t numInterfaces_;
+	bool multiInterface_;
 
 	std::thread receiveThread_;
 	std::mutex mLock_;
+
+	//The packet ring backend. Its receive side is drained by ringThread_ and senders take ringLock_ to use its transmit
+	//side. Link addresses of devices not yet connected wait in linkAddrs_, keyed by I.P. address under enumerateLock_.
+	std::unique_ptr<PacketRing> packetRing_;
+	std::thread ringThread_;
+	std::atomic<bool> ringRunning_;
+	std::mutex ringLock_;
+	unordered_map<uint32_t, uint64_t> linkAddrs_;
+
+	//Busy-poll the receive side and spin readers; see set_low_latency
+	std::atomic<bool> lowLatency_;
+	unsigned busyPollUS_;
+
+	//Asynchronous jobs and reply handlers get their own io_service as some jobs block; the receive thread must never wait
+	asio::io_service workIos_;
+	std::unique_ptr<asio::io_service::work> work_;
+	vector<std::thread> workerThreads_;
 };
 
 
@@ -1,40 +1,57 @@
 #include "APSEthernetPacket.h"
 
-APSEthernetPacket::APSEthernetPacket() : header{{}, {}, APS_PROTO, 0, {0}, 0}, payload(0){};
+const size_t PacketPayload::CAPACITY;
+const size_t APSEthernetPacket::MAX_PAYLOAD_WORDS;
+
+APSEthernetPacket::APSEthernetPacket() : header{{}, {}, APS_PROTO, 0, {0}, 0}, payload(){};
 
 APSEthernetPacket::APSEthernetPacket(const APSCommand_t & command, const uint32_t & addr /*see header for default addr=0 */) :
-		header{{}, {}, APS_PROTO, 0, command, addr}, payload(0){};
+		header{{}, {}, APS_PROTO, 0, command, addr}, payload(){};
 
 APSEthernetPacket::APSEthernetPacket(const MACAddr & destMAC, const MACAddr & srcMAC, APSCommand_t command, const uint32_t & addr) :
-		header{destMAC, srcMAC, APS_PROTO, 0, command, addr}, payload(0){};
+		header{destMAC, srcMAC, APS_PROTO, 0, command, addr}, payload(){};
 
 APSEthernetPacket::APSEthernetPacket(const vector<uint8_t> & packetData){
+	deserialize(packetData.data(), packetData.size());
+}
+
+APSEthernetPacket::APSEthernetPacket(const uint8_t * packetData, size_t length){
+	deserialize(packetData, length);
+}
+
+void APSEthernetPacket::deserialize(const uint8_t * packetData, size_t length){
 	/*
-	Create a packet from a byte array returned by pcap.
+	Fill in the packet from a byte array received off the wire.
 	*/
 	//Helper function to turn two network bytes into a uint16_t or uint32_t assuming big-endian network byte order
-	auto bytes2uint16 = [&packetData](size_t offset) -> uint16_t {return (packetData[offset] << 8) + packetData[offset+1];};
-	auto bytes2uint32 = [&packetData](size_t offset) -> uint32_t {return (packetData[offset] << 24) + (packetData[offset+1] << 16) + (packetData[offset+2] << 8) + packetData[offset+3] ;};
+	auto bytes2uint16 = [packetData](size_t offset) -> uint16_t {return (packetData[offset] << 8) + packetData[offset+1];};
+	auto bytes2uint32 = [packetData](size_t offset) -> uint32_t {return (packetData[offset] << 24) + (packetData[offset+1] << 16) + (packetData[offset+2] << 8) + packetData[offset+3] ;};
+
+	payload.clear();
+	if (length < NUM_HEADER_BYTES - 4) {
+		header = APSEthernetHeader{{}, {}, 0, 0, {0}, 0};
+		return;
+	}
 
-	std::copy(packetData.begin(), packetData.begin()+6, header.dest.addr.begin());
-	std::copy(packetData.begin()+6, packetData.begin()+12, header.src.addr.begin());
+	std::copy(packetData, packetData+6, header.dest.addr.begin());
+	std::copy(packetData+6, packetData+12, header.src.addr.begin());
 	header.frameType = bytes2uint16(12);
 	header.seqNum = bytes2uint16(14);
 	header.command.packed = bytes2uint32(16);
 
 	size_t myOffset;
 	//not all return packets have an address; if-block on command type and whether it is an acknowledge
-	if (!header.command.ack && needs_address(APS_COMMANDS(header.command.cmd))){
+	if (!header.command.ack && needs_address(APS_COMMANDS(header.command.cmd)) && length >= NUM_HEADER_BYTES){
 		header.addr = bytes2uint32(20);
 		myOffset = 24;
 	}
 	else{
+		header.addr = 0;
 		myOffset = 20;
 	}
-	payload.clear();
-	payload.reserve((packetData.size() - myOffset)/4);
-	while(myOffset < packetData.size()){
-		payload.push_back(bytes2uint32(myOffset));
+	payload.resize(std::min((length - myOffset)/4, MAX_PAYLOAD_WORDS));
+	for (auto & word : payload){
+		word = bytes2uint32(myOffset);
 		myOffset += 4;
 	}
 }
@@ -42,47 +59,52 @@ APSEthernetPacket::APSEthernetPacket(const vector<uint8_t> & packetData){
 vector<uint8_t> APSEthernetPacket::serialize() const {
 	/*
 	 * Serialize a packet to a vector of bytes for transmission.
+	 */
+	vector<uint8_t> outVec(numBytes());
+	serialize(outVec.data());
+	return outVec;
+}
+
+size_t APSEthernetPacket::serialize(uint8_t * buffer) const {
+	/*
+	 * Serialize a packet straight into a wire buffer of at least numBytes() bytes and return the number of bytes written.
 	 * Handle host to network byte ordering here
 	 */
-	vector<uint8_t> outVec;
-	outVec.resize(numBytes(), 0);
+	size_t length = numBytes();
 
 	//Push on the destination and source mac address
-	auto insertPt = outVec.begin();
+	uint8_t * insertPt = buffer;
 	std::copy(header.dest.addr.begin(), header.dest.addr.end(), insertPt); insertPt += 6;
 	std::copy(header.src.addr.begin(), header.src.addr.end(), insertPt); insertPt += 6;
 
 	//Push on ethernet protocol
-	uint16_t myuint16;
-	uint8_t * start;
-	start = reinterpret_cast<uint8_t*>(&myuint16);
-	myuint16 = htons(header.frameType);
-	std::copy(start, start+2, insertPt); insertPt += 2;
+	uint16_t myuint16 = htons(header.frameType);
+	std::memcpy(insertPt, &myuint16, 2); insertPt += 2;
 
 	//Sequence number
 	myuint16 = htons(header.seqNum);
-	std::copy(start, start+2, insertPt); insertPt += 2;
+	std::memcpy(insertPt, &myuint16, 2); insertPt += 2;
 
 	//Command
-	//TODO: command count field
-	uint32_t myuint32;
-	start = reinterpret_cast<uint8_t*>(&myuint32);
-	myuint32 = htonl(header.command.packed);
-	std::copy(start, start+4, insertPt); insertPt += 4;
+	uint32_t myuint32 = htonl(header.command.packed);
+	std::memcpy(insertPt, &myuint32, 4); insertPt += 4;
 
 	//Address
 	if (needs_address(APS_COMMANDS(header.command.cmd))){
 		myuint32 = htonl(header.addr);
-		std::copy(start, start+4, insertPt); insertPt += 4;
+		std::memcpy(insertPt, &myuint32, 4); insertPt += 4;
 	}
 
 	//Data
 	for (auto word : payload){
 		myuint32 = htonl(word);
-		std::copy(start, start+4, insertPt); insertPt += 4;
+		std::memcpy(insertPt, &myuint32, 4); insertPt += 4;
 	}
 
-	return outVec;
+	//Zero pad short packets out to the minimum frame size
+	std::fill(insertPt, buffer + length, 0);
+
+	return length;
 }
 
 size_t APSEthernetPacket::numBytes() const{
@@ -51,10 +51,54 @@ struct APSEthernetHeader {
 	uint32_t addr;
 };
 
+//Payload words are stored inline so a packet never touches the heap; CNT caps a packet at CAPACITY words
+class PacketPayload {
+public:
+	typedef uint32_t value_type;
+	static const size_t CAPACITY = 366;
+
+	PacketPayload() : size_{0} {};
+	PacketPayload(const vector<uint32_t> & data) : size_{0} { assign(data.begin(), data.end()); };
+	PacketPayload(const PacketPayload & other) : size_{0} { assign(other.begin(), other.end()); };
+	PacketPayload & operator=(const PacketPayload & other) { assign(other.begin(), other.end()); return *this; };
+
+	template <typename InputIt>
+	void assign(InputIt first, InputIt last) {
+		resize(std::distance(first, last));
+		std::copy(first, last, words_);
+	}
+	void push_back(const uint32_t & word) {
+		resize(size_ + 1);
+		words_[size_ - 1] = word;
+	}
+	void resize(size_t size) {
+		if (size > CAPACITY) {
+			throw runtime_error("Packet payload exceeds the protocol limit");
+		}
+		size_ = size;
+	}
+	void clear() { size_ = 0; };
+
+	size_t size() const { return size_; };
+	bool empty() const { return size_ == 0; };
+
+	uint32_t & operator[](size_t idx) { return words_[idx]; };
+	const uint32_t & operator[](size_t idx) const { return words_[idx]; };
+
+	uint32_t * begin() { return words_; };
+	uint32_t * end() { return words_ + size_; };
+	const uint32_t * begin() const { return words_; };
+	const uint32_t * end() const { return words_ + size_; };
+
+private:
+	size_t size_;
+	uint32_t words_[CAPACITY];
+};
+
 class APSEthernetPacket{
 public:
 	APSEthernetHeader header;
-	vector<uint32_t> payload;
+	PacketPayload payload;
 
 	APSEthernetPacket();
 
@@ -62,10 +106,15 @@ public:
 	APSEthernetPacket(const MACAddr &, const MACAddr &, APSCommand_t, const uint32_t &);
 
 	APSEthernetPacket(const vector<uint8_t> &);
+	APSEthernetPacket(const uint8_t *, size_t);
 	
 	static const size_t NUM_HEADER_BYTES = 24;
+	static const size_t MAX_PAYLOAD_WORDS = PacketPayload::CAPACITY;
+	static const size_t MAX_NUM_BYTES = NUM_HEADER_BYTES + 4*MAX_PAYLOAD_WORDS;
 
 	vector<uint8_t> serialize() const ;
+	size_t serialize(uint8_t *) const;
+	void deserialize(const uint8_t *, size_t);
 	size_t numBytes() const; 
 
 	static APSEthernetPacket create_broadcast_packet();
@@ -4,10 +4,9 @@
     #include <iphlpapi.h>
 #endif
 
-MACAddr::MACAddr() : addr(MAC_ADDR_LEN, 0){}
+MACAddr::MACAddr() : addr{}{}
 
-MACAddr::MACAddr(const string & macStr){
-	addr.resize(6,0);
+MACAddr::MACAddr(const string & macStr) : addr{}{
     std::istringstream macStream(macStr);
     for (uint8_t & macByte : addr){
         int byte;
@@ -18,9 +17,12 @@ MACAddr::MACAddr(const string & macStr){
 }
 
 MACAddr::MACAddr(const uint8_t * macAddrBytes){
-	addr.clear();
-    for (size_t ct=0; ct<6; ct++){
-        addr.push_back(macAddrBytes[ct]);
+    std::copy(macAddrBytes, macAddrBytes + MAC_ADDR_LEN, addr.begin());
+}
+
+MACAddr::MACAddr(const uint64_t & mac){
+    for (size_t ct = 0; ct < MAC_ADDR_LEN; ct++){
+        addr[ct] = (mac >> 8*(MAC_ADDR_LEN - 1 - ct)) & 0xff;
     }
 }
 
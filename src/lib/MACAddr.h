@@ -11,6 +11,8 @@ public:
 	MACAddr();
 	MACAddr(const uint8_t *);
 	MACAddr(const string &);
+	//From the low 48 bits, most significant byte first, as returned by APS2::get_mac_addr
+	explicit MACAddr(const uint64_t &);
 
 	bool operator==(const MACAddr & other) const{
 		return (addr == other.addr);
@@ -20,7 +22,7 @@ public:
 	static bool is_valid(const string &);
 	static const unsigned int MAC_ADDR_LEN = 6;
 
-	vector<uint8_t> addr;
+	std::array<uint8_t, 6> addr;
 
 };
 
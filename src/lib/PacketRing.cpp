@@ -0,0 +1,333 @@
+#include "PacketRing.h"
+#include "logger.h"
+
+#ifdef HAVE_PACKET_MMAP
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <cerrno>
+
+namespace {
+inline void put16(uint8_t * p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+inline void put32(uint8_t * p, uint32_t value) {
+    put16(p, value >> 16);
+    put16(p + 2, value & 0xffff);
+}
+
+inline void put_mac(uint8_t * p, uint64_t mac) {
+    for (size_t ct = 0; ct < 6; ct++) {
+        p[ct] = (mac >> 8*(5 - ct)) & 0xff;
+    }
+}
+
+inline uint16_t get16(const uint8_t * p) {
+    return (p[0] << 8) | p[1];
+}
+
+inline uint32_t get32(const uint8_t * p) {
+    return (static_cast<uint32_t>(get16(p)) << 16) | get16(p + 2);
+}
+
+inline uint64_t get_mac(const uint8_t * p) {
+    uint64_t mac = 0;
+    for (size_t ct = 0; ct < 6; ct++) {
+        mac = (mac << 8) | p[ct];
+    }
+    return mac;
+}
+
+uint16_t ip_checksum(const uint8_t * header, size_t length) {
+    uint32_t sum = 0;
+    for (size_t ct = 0; ct < length; ct += 2) {
+        sum += get16(header + ct);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+//Frame status words are shared with the kernel
+inline uint32_t frame_status(const uint8_t * frame) {
+    return __atomic_load_n(&reinterpret_cast<const tpacket2_hdr *>(frame)->tp_status, __ATOMIC_ACQUIRE);
+}
+
+inline void set_frame_status(uint8_t * frame, uint32_t status) {
+    __atomic_store_n(&reinterpret_cast<tpacket2_hdr *>(frame)->tp_status, status, __ATOMIC_RELEASE);
+}
+
+//Frame data starts this far into a transmit frame
+const size_t TX_DATA_OFFSET = TPACKET2_HDRLEN - sizeof(sockaddr_ll);
+
+//First interface that is up, isn't the loopback and has an IPv4 address
+string default_interface() {
+    ifaddrs * addrs;
+    if (getifaddrs(&addrs) != 0) {
+        return "";
+    }
+    string name;
+    for (ifaddrs * ifa = addrs; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET && (ifa->ifa_flags & IFF_UP) && !(ifa->ifa_flags & IFF_LOOPBACK)) {
+            name = ifa->ifa_name;
+            break;
+        }
+    }
+    freeifaddrs(addrs);
+    return name;
+}
+}
+
+PacketRing::PacketRing() : fd_{-1}, ring_{nullptr}, ringSize_{0}, numFrames_{0}, rxIndex_{0}, txIndex_{0}, numQueued_{0},
+    port_{0}, srcMAC_{0}, srcIP_{0}, ipID_{0}, drops_{0} {}
+
+PacketRing::~PacketRing() {
+    close();
+}
+
+bool PacketRing::open(const string & interface, uint16_t port) {
+    close();
+    interface_ = interface.empty() ? default_interface() : interface;
+    port_ = port;
+    if (interface_.empty()) {
+        FILE_LOG(logERROR) << "No network interface found for the packet ring";
+        return false;
+    }
+
+    //Protocol 0 means nothing comes in until we bind below, by which time the filter is in place
+    fd_ = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd_ < 0) {
+        FILE_LOG(logERROR) << "Unable to open packet socket: " << strerror(errno);
+        return false;
+    }
+
+    auto fail = [&](const string & what){
+        FILE_LOG(logERROR) << "Unable to set up the packet ring on " << interface_ << ": " << what << ": " << strerror(errno);
+        close();
+        return false;
+    };
+
+    //Look up the interface's index and addresses for the frame headers
+    ifreq ifr;
+    std::memset(&ifr, 0, sizeof(ifr));
+    std::strncpy(ifr.ifr_name, interface_.c_str(), IFNAMSIZ - 1);
+    if (ioctl(fd_, SIOCGIFINDEX, &ifr) != 0) return fail("interface index");
+    int ifIndex = ifr.ifr_ifindex;
+    if (ioctl(fd_, SIOCGIFHWADDR, &ifr) != 0) return fail("hardware address");
+    srcMAC_ = get_mac(reinterpret_cast<const uint8_t *>(ifr.ifr_hwaddr.sa_data));
+    if (ioctl(fd_, SIOCGIFADDR, &ifr) != 0) return fail("I.P. address");
+    srcIP_ = ntohl(reinterpret_cast<const sockaddr_in *>(&ifr.ifr_addr)->sin_addr.s_addr);
+
+    int version = TPACKET_V2;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) return fail("ring version");
+    //Let the kernel drop malformed frames rather than leave them stuck in the transmit ring
+    int loss = 1;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) != 0) return fail("loss option");
+#ifdef PACKET_QDISC_BYPASS
+    //Hand frames straight to the driver; not fatal if the kernel is too old for it
+    int bypass = 1;
+    setsockopt(fd_, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass));
+#endif
+
+    //Only UDP datagrams to our port, and no fragments, make it into the receive ring (udp dst port <port>)
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    sock_fprog filter = {static_cast<unsigned short>(sizeof(code) / sizeof(code[0])), code};
+    if (setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0) return fail("socket filter");
+
+    //Both rings are mapped in one go, receive ring first
+    tpacket_req req;
+    req.tp_block_size = BLOCK_SIZE;
+    req.tp_block_nr = NUM_BLOCKS;
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr = BLOCK_SIZE / FRAME_SIZE * NUM_BLOCKS;
+    if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) return fail("receive ring");
+    if (setsockopt(fd_, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) return fail("transmit ring");
+    numFrames_ = req.tp_frame_nr;
+    ringSize_ = 2 * BLOCK_SIZE * NUM_BLOCKS;
+    void * ring = mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (ring == MAP_FAILED) return fail("mapping the rings");
+    ring_ = static_cast<uint8_t *>(ring);
+    rxIndex_ = txIndex_ = numQueued_ = 0;
+    drops_ = 0;
+
+    sockaddr_ll addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex = ifIndex;
+    if (bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) return fail("binding");
+
+    FILE_LOG(logINFO) << "Opened packet ring on " << interface_ << " with " << numFrames_ << " frames each way";
+    return true;
+}
+
+void PacketRing::close() {
+    if (ring_) {
+        munmap(ring_, ringSize_);
+        ring_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+uint8_t * PacketRing::next_payload() {
+    uint8_t * frame = tx_frame(txIndex_);
+    //The ring is full; get the kernel working through it and wait for the frame to come free
+    while (frame_status(frame) != TP_STATUS_AVAILABLE) {
+        flush();
+        pollfd pfd = {fd_, POLLOUT, 0};
+        poll(&pfd, 1, 1);
+    }
+    return frame + TX_DATA_OFFSET + HEADER_BYTES;
+}
+
+void PacketRing::commit(uint64_t destMAC, uint32_t destIP, uint16_t destPort, size_t payloadLength) {
+    uint8_t * frame = tx_frame(txIndex_);
+    uint8_t * eth = frame + TX_DATA_OFFSET;
+    put_mac(eth, destMAC);
+    put_mac(eth + 6, srcMAC_);
+    put16(eth + 12, ETH_P_IP);
+
+    uint8_t * ip = eth + 14;
+    put16(ip, 0x4500);
+    put16(ip + 2, 20 + 8 + payloadLength);
+    put16(ip + 4, ipID_++);
+    put16(ip + 6, 0x4000); //don't fragment
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    put16(ip + 10, 0);
+    put32(ip + 12, srcIP_);
+    put32(ip + 16, destIP);
+    put16(ip + 10, ip_checksum(ip, 20));
+
+    //The UDP checksum is optional over IPv4 and the Ethernet CRC already covers the frame
+    uint8_t * udpHeader = ip + 20;
+    put16(udpHeader, port_);
+    put16(udpHeader + 2, destPort);
+    put16(udpHeader + 4, 8 + payloadLength);
+    put16(udpHeader + 6, 0);
+
+    reinterpret_cast<tpacket2_hdr *>(frame)->tp_len = HEADER_BYTES + payloadLength;
+    set_frame_status(frame, TP_STATUS_SEND_REQUEST);
+    txIndex_ = (txIndex_ + 1) % numFrames_;
+    numQueued_++;
+}
+
+void PacketRing::flush() {
+    if (numQueued_ == 0) {
+        return;
+    }
+    while (send(fd_, nullptr, 0, 0) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        FILE_LOG(logERROR) << "Packet ring send failed with error: " << strerror(errno);
+        throw runtime_error("Failed to send packets");
+    }
+    numQueued_ = 0;
+}
+
+size_t PacketRing::receive(int timeoutMS, const Handler & handler) {
+    size_t numFrames = 0;
+    bool waited = false;
+    while (true) {
+        uint8_t * frame = rx_frame(rxIndex_);
+        if (!(frame_status(frame) & TP_STATUS_USER)) {
+            if (numFrames || waited || timeoutMS == 0) {
+                return numFrames;
+            }
+            pollfd pfd = {fd_, POLLIN, 0};
+            poll(&pfd, 1, timeoutMS);
+            waited = true;
+            continue;
+        }
+
+        //Skip our own frames going out and anything that isn't a whole UDP datagram to our port
+        const tpacket2_hdr * header = reinterpret_cast<const tpacket2_hdr *>(frame);
+        const sockaddr_ll * link = reinterpret_cast<const sockaddr_ll *>(frame + TPACKET_ALIGN(sizeof(tpacket2_hdr)));
+        const uint8_t * eth = frame + header->tp_mac;
+        size_t length = header->tp_snaplen;
+        if (link->sll_pkttype != PACKET_OUTGOING && length >= HEADER_BYTES && get16(eth + 12) == ETH_P_IP) {
+            const uint8_t * ip = eth + 14;
+            size_t ipHeaderBytes = 4 * (ip[0] & 0x0f);
+            if ((ip[0] >> 4) == 4 && ip[9] == IPPROTO_UDP && !(get16(ip + 6) & 0x3fff) &&
+                    ipHeaderBytes >= 20 && length >= 14 + ipHeaderBytes + 8) {
+                const uint8_t * udpHeader = ip + ipHeaderBytes;
+                size_t payloadLength = std::min<size_t>(get16(udpHeader + 4), length - 14 - ipHeaderBytes);
+                if (get16(udpHeader + 2) == port_ && payloadLength >= 8) {
+                    handler(get_mac(eth + 6), get32(ip + 12), get16(udpHeader), udpHeader + 8, payloadLength - 8);
+                }
+            }
+        }
+
+        set_frame_status(frame, TP_STATUS_KERNEL);
+        rxIndex_ = (rxIndex_ + 1) % numFrames_;
+        numFrames++;
+    }
+}
+
+uint64_t PacketRing::dropped() {
+    //Reading the statistics resets them so keep a running total
+    tpacket_stats stats;
+    socklen_t length = sizeof(stats);
+    if (fd_ >= 0 && getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &stats, &length) == 0) {
+        drops_ += stats.tp_drops;
+    }
+    return drops_;
+}
+
+#else
+
+PacketRing::PacketRing() : fd_{-1}, ring_{nullptr}, ringSize_{0}, numFrames_{0}, rxIndex_{0}, txIndex_{0}, numQueued_{0},
+    port_{0}, srcMAC_{0}, srcIP_{0}, ipID_{0}, drops_{0} {}
+
+PacketRing::~PacketRing() {}
+
+bool PacketRing::open(const string & interface, uint16_t port) {
+    FILE_LOG(logERROR) << "Packet rings are not available on this platform";
+    return false;
+}
+
+void PacketRing::close() {}
+
+uint8_t * PacketRing::next_payload() {
+    return nullptr;
+}
+
+void PacketRing::commit(uint64_t destMAC, uint32_t destIP, uint16_t destPort, size_t payloadLength) {}
+
+void PacketRing::flush() {}
+
+size_t PacketRing::receive(int timeoutMS, const Handler & handler) {
+    return 0;
+}
+
+uint64_t PacketRing::dropped() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * PacketRing.h
+ *
+ * AF_PACKET socket with memory mapped receive and transmit rings. APS datagrams are written straight into the
+ * transmit ring as complete Ethernet/IPv4/UDP frames and read straight out of the receive ring, so a whole batch
+ * costs one system call and no copies through the socket layer. Linux only; elsewhere open() always fails.
+ */
+
+#include "headings.h"
+
+#ifndef PACKETRING_H_
+#define PACKETRING_H_
+
+#ifdef __linux__
+#define HAVE_PACKET_MMAP
+#endif
+
+class PacketRing
+{
+public:
+	//Geometry of each ring: FRAME_SIZE holds a full APS packet plus all the headers
+	static const size_t FRAME_SIZE = 2048;
+	static const size_t BLOCK_SIZE = 1 << 16;
+	static const size_t NUM_BLOCKS = 32;
+
+	//Ethernet, IPv4 and UDP headers in front of every payload
+	static const size_t HEADER_BYTES = 14 + 20 + 8;
+
+	//Called for each datagram taken off the receive ring with the sender's link address, I.P. address and port
+	typedef std::function<void(uint64_t, uint32_t, uint16_t, const uint8_t *, size_t)> Handler;
+
+	PacketRing();
+	~PacketRing();
+
+	PacketRing(const PacketRing &) = delete;
+	PacketRing & operator=(const PacketRing &) = delete;
+
+	//Open the rings on an interface and only take in UDP datagrams for port. An empty interface name picks the
+	//first interface that is up and has an IPv4 address. Needs CAP_NET_RAW.
+	bool open(const string & interface, uint16_t port);
+	void close();
+	bool is_open() const { return fd_ >= 0; };
+	const string & interface() const { return interface_; };
+
+	//Transmit side; callers have to serialize. next_payload gives the payload area of the next free frame, waiting
+	//for the kernel to free one if the ring is full; commit wraps the payload written there in headers and queues the
+	//frame; flush hands everything queued to the kernel with a single system call.
+	uint8_t * next_payload();
+	void commit(uint64_t destMAC, uint32_t destIP, uint16_t destPort, size_t payloadLength);
+	void flush();
+
+	//Receive side; only one thread may call this. Hands every datagram waiting in the ring to handler, first waiting
+	//up to timeoutMS for one to arrive if there are none. Returns the number of frames taken off the ring.
+	size_t receive(int timeoutMS, const Handler & handler);
+
+	//Frames the kernel dropped because the receive ring was full since the ring was opened
+	uint64_t dropped();
+
+private:
+	int fd_;
+	uint8_t * ring_;
+	size_t ringSize_;
+	size_t numFrames_;
+	size_t rxIndex_;
+	size_t txIndex_;
+	size_t numQueued_;
+
+	string interface_;
+	uint16_t port_;
+	uint64_t srcMAC_;
+	uint32_t srcIP_;
+	uint16_t ipID_;
+	std::atomic<uint64_t> drops_;
+
+	uint8_t * rx_frame(size_t index) const { return ring_ + index * FRAME_SIZE; };
+	uint8_t * tx_frame(size_t index) const { return ring_ + ringSize_ / 2 + index * FRAME_SIZE; };
+};
+
+#endif
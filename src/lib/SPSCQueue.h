@@ -0,0 +1,85 @@
+/*
+ * SPSCQueue.h
+ *
+ * Bounded lock-free ring for handing items from exactly one producer thread to exactly one consumer thread.
+ */
+
+#include "headings.h"
+
+#ifndef SPSCQUEUE_H_
+#define SPSCQUEUE_H_
+
+template <typename T>
+class SPSCQueue
+{
+public:
+	//Capacity is rounded up to a power of two so indices can be masked
+	explicit SPSCQueue(size_t capacity) : head_{0}, tail_{0} {
+		size_t size = 1;
+		while (size < capacity) size <<= 1;
+		slots_.resize(size);
+		mask_ = size - 1;
+	}
+
+	SPSCQueue(const SPSCQueue &) = delete;
+	SPSCQueue & operator=(const SPSCQueue &) = delete;
+
+	//Producer side: the next free slot to fill in place, or nullptr if the ring is full. The slot only becomes
+	//visible to the consumer once publish() is called; slots are recycled so filling one never allocates.
+	T * claim() {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) > mask_) {
+			return nullptr;
+		}
+		return &slots_[tail & mask_];
+	}
+
+	void publish() {
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	//Producer side: construct an item in the next free slot; returns false if the ring is full
+	template <typename... Args>
+	bool try_emplace(Args&&... args) {
+		T * slot = claim();
+		if (!slot) {
+			return false;
+		}
+		*slot = T(std::forward<Args>(args)...);
+		publish();
+		return true;
+	}
+
+	//Consumer side: the oldest item, only valid when !empty()
+	T & front() {
+		return slots_[head_.load(std::memory_order_relaxed) & mask_];
+	}
+
+	void pop() {
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool empty() const {
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+
+	size_t size() const {
+		return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const {
+		return mask_ + 1;
+	}
+
+private:
+	vector<T> slots_;
+	size_t mask_;
+
+	//Keep the producer and consumer indices on separate cache lines
+	char pad0_[64];
+	std::atomic<size_t> head_;
+	char pad1_[64];
+	std::atomic<size_t> tail_;
+};
+
+#endif /* SPSCQUEUE_H_ */
@@ -109,6 +109,12 @@ enum class APS_RESET_MODE_STAT : uint32_t {
 	SOFT_RESET     = 1,
 };
 
+//MODE/STAT of an acknowledge with the SEQ bit set
+enum SEQUENCE_ERROR_STAT {
+	SEQUENCE_DUPLICATE = 0,
+	SEQUENCE_SKIP = 1,
+};
+
 enum USERIO_MODE_STAT {
 	USERIO_SUCCESS = APS_SUCCESS,
 	USERIO_INVALID_CNT = APS_INVALID_CNT,
@@ -16,7 +16,9 @@
 #include <string>
 #include <cstring>
 #include <vector>
+#include <array>
 #include <queue>
+#include <deque>
 #include <unordered_map>
 #include <map>
 #include <set>
@@ -28,6 +30,7 @@
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <memory>
 
 using std::endl;
 using std::vector;
@@ -42,9 +45,12 @@ using std::runtime_error;
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <utility>
 #include <chrono>
+#include <future>
+#include <functional>
 
 
 //We often deal with vectors of 16bit values
@@ -9,9 +9,14 @@
 #include <sstream>
 #include "asio.hpp"
 
-map<string, APS2> APSs; //map to hold on to the APS instances
+map<string, std::shared_ptr<APS2>> APSs; //map to hold on to the APS instances
 set<string> deviceSerials; // set of APSs that responded to an enumerate broadcast
 
+//What enumerate waits for before returning early; see set_enumerate_options
+size_t enumerateExpectedDevices = 0;
+vector<MACAddr> enumerateExpectedMACs;
+size_t enumerateTimeoutMS = DEFAULT_ENUMERATE_TIMEOUT_MS;
+
 
 // stub class to close the logger file handle when the driver goes out of scope
 class CleanUp {
@@ -26,6 +31,86 @@ CleanUp::~CleanUp() {
 }
 CleanUp cleanup_;
 
+//The APS instance for a device named in a C call. Asynchronous jobs hold their own reference so a re-enumerate that
+//drops the device can't destroy it under them.
+static std::shared_ptr<APS2> & get_APS_ptr(const string & deviceSerial) {
+	auto & aps = APSs[deviceSerial];
+	if (!aps) {
+		aps.reset(new APS2());
+	}
+	return aps;
+}
+static APS2 & get_APS(const char * deviceSerial) {
+	return *get_APS_ptr(string(deviceSerial));
+}
+
+//Transport handle for a device named in a C call. Only looks the device up; the transport settings belong to an APS2
+//that has been connected, so this never opens a connection behind the caller's back.
+static DeviceHandle device_handle(const char * deviceSerial) {
+	DeviceHandle handle = APSEthernet::get_instance().find_handle(string(deviceSerial));
+	if (handle == INVALID_DEVICE_HANDLE) {
+		throw std::runtime_error("No APS2 at " + string(deviceSerial) + "; connect to it first");
+	}
+	return handle;
+}
+
+//Exceptions must not cross into C callers. Failures are logged and come back as APS_UNKNOWN_ERROR, or as errorValue
+//from the calls that return a value rather than a status.
+template <typename R, typename F>
+R catch_errors(const char * deviceSerial, F func, R errorValue = R(APS_UNKNOWN_ERROR)) {
+	try {
+		return func();
+	} catch (std::exception & e) {
+		FILE_LOG(logERROR) << "Call on " << deviceSerial << " failed: " << e.what();
+		return errorValue;
+	}
+}
+
+//Run an APS2 operation on the driver's asynchronous workers and report its return code through the callback
+template <typename F>
+int run_with_callback(const char * deviceSerial, F func, APSCompletionCallback callback, void * userData) {
+	string serial(deviceSerial);
+	std::shared_ptr<APS2> aps = get_APS_ptr(serial);
+	auto job = [serial, aps, func, callback, userData](){
+		int result;
+		try {
+			result = func(*aps);
+		} catch (std::exception & e) {
+			FILE_LOG(logERROR) << "Asynchronous operation on " << serial << " failed: " << e.what();
+			result = APS_UNKNOWN_ERROR;
+		}
+		if (callback) {
+			callback(serial.c_str(), result, userData);
+		}
+	};
+	//A failure to queue is reported here and the callback is never called
+	return catch_errors<int>(deviceSerial, [&](){
+		APSEthernet::get_instance().post(aps->handle(), job);
+		return APS_OK;
+	});
+}
+
+//Report the outcome of an APS2 query operation through a C callback; store copies the result out for the caller
+template <typename R, typename F>
+std::function<void(std::exception_ptr, R)> query_callback(const string & serial, std::shared_ptr<APS2> aps, F store, APSCompletionCallback callback, void * userData) {
+	return [serial, aps, store, callback, userData](std::exception_ptr error, R result){
+		int status = APS_OK;
+		if (error) {
+			try {
+				std::rethrow_exception(error);
+			} catch (std::exception & e) {
+				FILE_LOG(logERROR) << "Asynchronous operation on " << serial << " failed: " << e.what();
+			}
+			status = APS_UNKNOWN_ERROR;
+		} else {
+			store(result);
+		}
+		if (callback) {
+			callback(serial.c_str(), status, userData);
+		}
+	};
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -61,7 +146,7 @@ int enumerate_devices(){
 	*/
 
 	set<string> oldSerials = deviceSerials;
-	deviceSerials = APSEthernet::get_instance().enumerate();
+	deviceSerials = APSEthernet::get_instance().enumerate(enumerateExpectedDevices, enumerateExpectedMACs, enumerateTimeoutMS);
 
 	//See if any devices have been removed
 	set<string> diffSerials;
@@ -71,11 +156,21 @@ int enumerate_devices(){
 	//Or if any devices have been added
 	diffSerials.clear();
 	set_difference(deviceSerials.begin(), deviceSerials.end(), oldSerials.begin(), oldSerials.end(), std::inserter(diffSerials, diffSerials.begin()));
-	for (auto serial : diffSerials) APSs[serial] = APS2(serial);
+	for (auto serial : diffSerials) APSs[serial] = std::make_shared<APS2>(serial);
 
 	return APS_OK;
 }
 
+int set_enumerate_options(int expectedDevices, uint64_t* expectedMACs, int numMACs, int timeoutMS){
+	enumerateExpectedDevices = std::max(expectedDevices, 0);
+	enumerateExpectedMACs.clear();
+	for (int ct = 0; ct < numMACs; ct++) {
+		enumerateExpectedMACs.push_back(MACAddr(expectedMACs[ct]));
+	}
+	enumerateTimeoutMS = timeoutMS > 0 ? timeoutMS : DEFAULT_ENUMERATE_TIMEOUT_MS;
+	return APS_OK;
+}
+
 int get_numDevices(){
 	return deviceSerials.size();
 }
@@ -83,7 +178,8 @@ int get_numDevices(){
 void get_deviceSerials(const char ** deviceSerialsOut){
 	//Assumes sufficient memory has been allocated
 	size_t ct = 0;
-	for (auto serial : deviceSerials){
+	//Point at our own copies so the strings outlive the call
+	for (const auto & serial : deviceSerials){
 		deviceSerialsOut[ct] = serial.c_str();
 		ct++;
 	}
@@ -91,24 +187,24 @@ void get_deviceSerials(const char ** deviceSerialsOut){
 
 //Connect to a device specified by serial number string
 //Assumes null-terminated deviceSerial
-int connect_APS(const char * deviceSerial){
-	return APSs[string(deviceSerial)].connect();
+int connect_APS(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).connect(); });
 }
 
 //Assumes a null-terminated deviceSerial
-int disconnect_APS(const char * deviceSerial){
-	return APSs[string(deviceSerial)].disconnect();
+int disconnect_APS(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).disconnect(); });
 }
 
-int reset(const char * deviceSerial, int resetMode){
-	return APSs[string(deviceSerial)].reset(static_cast<APS_RESET_MODE_STAT>(resetMode));
+int reset(const char * deviceSerial, int resetMode) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).reset(static_cast<APS_RESET_MODE_STAT>(resetMode)); });
 }
 
 //Initialize an APS unit
 //Assumes null-terminated bitFile
 int initAPS(const char * deviceSerial, int forceReload){
 	try {
-		return APSs[string(deviceSerial)].init(forceReload);
+		return get_APS(deviceSerial).init(forceReload);
 	} catch (std::exception& e) {
 		string error = e.what();
 		if (error.compare("Unable to open bitfile.") == 0) {
@@ -121,43 +217,43 @@ int initAPS(const char * deviceSerial, int forceReload){
 }
 
 int get_firmware_version(const char * deviceSerial) {
-	return APSs[string(deviceSerial)].get_firmware_version();
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).get_firmware_version(); });
 }
 
-double get_uptime(const char * deviceSerial){
-	return APSs[string(deviceSerial)].get_uptime();
+double get_uptime(const char * deviceSerial) {
+	return catch_errors<double>(deviceSerial, [&](){ return get_APS(deviceSerial).get_uptime(); });
 }
 
-int set_sampleRate(const char * deviceSerial, int freq){
-	return APSs[string(deviceSerial)].set_sampleRate(freq);
+int set_sampleRate(const char * deviceSerial, int freq) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_sampleRate(freq); });
 }
 
-int get_sampleRate(const char * deviceSerial){
-	return APSs[string(deviceSerial)].get_sampleRate();
+int get_sampleRate(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).get_sampleRate(); });
 }
 
 //Load the waveform library as floats
-int set_waveform_float(const char * deviceSerial, int channelNum, float* data, int numPts){
-	return APSs[string(deviceSerial)].set_waveform( channelNum, vector<float>(data, data+numPts));
+int set_waveform_float(const char * deviceSerial, int channelNum, float* data, int numPts) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_waveform( channelNum, vector<float>(data, data+numPts)); });
 }
 
 //Load the waveform library as int16
-int set_waveform_int(const char * deviceSerial, int channelNum, int16_t* data, int numPts){
-	return APSs[string(deviceSerial)].set_waveform(channelNum, vector<int16_t>(data, data+numPts));
+int set_waveform_int(const char * deviceSerial, int channelNum, int16_t* data, int numPts) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_waveform(channelNum, vector<int16_t>(data, data+numPts)); });
 }
 
 int set_markers(const char * deviceSerial, int channelNum, uint8_t* data, int numPts) {
-	return APSs[string(deviceSerial)].set_markers(channelNum, vector<uint8_t>(data, data+numPts));
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_markers(channelNum, vector<uint8_t>(data, data+numPts)); });
 }
 
 int write_sequence(const char * deviceSerial, uint64_t* data, uint32_t numWords) {
 	vector<uint64_t> dataVec(data, data+numWords);
-	return APSs[string(deviceSerial)].write_sequence(dataVec);
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).write_sequence(dataVec); });
 }
 
 int load_sequence_file(const char * deviceSerial, const char * seqFile){
 	try {
-		return APSs[string(deviceSerial)].load_sequence_file(string(seqFile));
+		return get_APS(deviceSerial).load_sequence_file(string(seqFile));
 	} catch (...) {
 		return APS_UNKNOWN_ERROR;
 	}
@@ -166,19 +262,19 @@ int load_sequence_file(const char * deviceSerial, const char * seqFile){
 }
 
 int clear_channel_data(const char * deviceSerial) {
-	return APSs[string(deviceSerial)].clear_channel_data();
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).clear_channel_data(); });
 }
 
 int run(const char * deviceSerial) {
-	return APSs[string(deviceSerial)].run();
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).run(); });
 }
 
 int stop(const char * deviceSerial) {
-	return APSs[string(deviceSerial)].stop();
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).stop(); });
 }
 
-int get_running(const char * deviceSerial){
-	return APSs[string(deviceSerial)].running;
+int get_running(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).running; });
 }
 
 //Expects a null-terminated character array
@@ -213,43 +309,43 @@ int set_logging_level(int logLevel){
 }
 
 int set_trigger_source(const char * deviceSerial, int triggerSource) {
-	return APSs[string(deviceSerial)].set_trigger_source(TRIGGERSOURCE(triggerSource));
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_trigger_source(TRIGGERSOURCE(triggerSource)); });
 }
 
 int get_trigger_source(const char * deviceSerial) {
-	return int(APSs[string(deviceSerial)].get_trigger_source());
+	return catch_errors<int>(deviceSerial, [&](){ return int(get_APS(deviceSerial).get_trigger_source()); });
 }
 
-int set_trigger_interval(const char * deviceSerial, double interval){
-	return APSs[string(deviceSerial)].set_trigger_interval(interval);
+int set_trigger_interval(const char * deviceSerial, double interval) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_trigger_interval(interval); });
 }
 
-double get_trigger_interval(const char * deviceSerial){
-	return APSs[string(deviceSerial)].get_trigger_interval();
+double get_trigger_interval(const char * deviceSerial) {
+	return catch_errors<double>(deviceSerial, [&](){ return get_APS(deviceSerial).get_trigger_interval(); });
 }
 
-int set_channel_offset(const char * deviceSerial, int channelNum, float offset){
-	return APSs[string(deviceSerial)].set_channel_offset(channelNum, offset);
+int set_channel_offset(const char * deviceSerial, int channelNum, float offset) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_channel_offset(channelNum, offset); });
 }
-int set_channel_scale(const char * deviceSerial, int channelNum, float scale){
-	return APSs[string(deviceSerial)].set_channel_scale(channelNum, scale);
+int set_channel_scale(const char * deviceSerial, int channelNum, float scale) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_channel_scale(channelNum, scale); });
 }
-int set_channel_enabled(const char * deviceSerial, int channelNum, int enable){
-	return APSs[string(deviceSerial)].set_channel_enabled(channelNum, enable);
+int set_channel_enabled(const char * deviceSerial, int channelNum, int enable) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_channel_enabled(channelNum, enable); });
 }
 
-float get_channel_offset(const char * deviceSerial, int channelNum){
-	return APSs[string(deviceSerial)].get_channel_offset(channelNum);
+float get_channel_offset(const char * deviceSerial, int channelNum) {
+	return catch_errors<float>(deviceSerial, [&](){ return get_APS(deviceSerial).get_channel_offset(channelNum); });
 }
-float get_channel_scale(const char * deviceSerial, int channelNum){
-	return APSs[string(deviceSerial)].get_channel_scale(channelNum);
+float get_channel_scale(const char * deviceSerial, int channelNum) {
+	return catch_errors<float>(deviceSerial, [&](){ return get_APS(deviceSerial).get_channel_scale(channelNum); });
 }
-int get_channel_enabled(const char * deviceSerial, int channelNum){
-	return APSs[string(deviceSerial)].get_channel_enabled(channelNum);
+int get_channel_enabled(const char * deviceSerial, int channelNum) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).get_channel_enabled(channelNum); });
 }
 
 int set_run_mode(const char * deviceSerial, int mode) {
-	return APSs[string(deviceSerial)].set_run_mode(RUN_MODE(mode));
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_run_mode(RUN_MODE(mode)); });
 }
 
 //int save_state_files() {
@@ -271,53 +367,260 @@ int set_run_mode(const char * deviceSerial, int mode) {
 
 int write_memory(const char * deviceSerial, uint32_t addr, uint32_t* data, uint32_t numWords) {
 	vector<uint32_t> dataVec(data, data+numWords);
-	return APSs[string(deviceSerial)].write_memory(addr, dataVec);
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).write_memory(addr, dataVec); });
 }
 
 int read_memory(const char * deviceSerial, uint32_t addr, uint32_t* data, uint32_t numWords) {
-	auto readData = APSs[string(deviceSerial)].read_memory(addr, numWords);
-	std::copy(readData.begin(), readData.end(), data);
-	return 0;
+	return catch_errors<int>(deviceSerial, [&](){
+		auto readData = get_APS(deviceSerial).read_memory(addr, numWords);
+		std::copy(readData.begin(), readData.end(), data);
+		return 0;
+	});
 }
 
 int read_register(const char * deviceSerial, uint32_t addr){
 	uint32_t buffer[1];
-	read_memory(deviceSerial, addr, buffer, 1);
+	if (read_memory(deviceSerial, addr, buffer, 1) != 0) {
+		return APS_UNKNOWN_ERROR;
+	}
 	return buffer[0];
 }
 
+int read_registers(const char * deviceSerial, uint32_t* addrs, uint32_t* data, uint32_t numRegs){
+	return catch_errors<int>(deviceSerial, [&](){
+		auto readData = get_APS(deviceSerial).read_registers(vector<uint32_t>(addrs, addrs+numRegs));
+		std::copy(readData.begin(), readData.end(), data);
+		return 0;
+	});
+}
+
 int program_FPGA(const char * deviceSerial, const char * bitFile) {
-	return APSs[string(deviceSerial)].program_FPGA(string(bitFile));
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).program_FPGA(string(bitFile)); });
 }
 
 int write_flash(const char * deviceSerial, uint32_t addr, uint32_t* data, uint32_t numWords) {
 	vector<uint32_t> writeData(data, data+numWords);
-	return APSs[string(deviceSerial)].write_flash(addr, writeData);
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).write_flash(addr, writeData); });
 }
 int read_flash(const char * deviceSerial, uint32_t addr, uint32_t numWords, uint32_t* data) {
-	auto readData = APSs[string(deviceSerial)].read_flash(addr, numWords);
-	std::copy(readData.begin(), readData.end(), data);
-	return 0;
+	return catch_errors<int>(deviceSerial, [&](){
+		auto readData = get_APS(deviceSerial).read_flash(addr, numWords);
+		std::copy(readData.begin(), readData.end(), data);
+		return 0;
+	});
 }
 uint64_t get_mac_addr(const char * deviceSerial) {
-	return APSs[string(deviceSerial)].get_mac_addr();
+	return catch_errors<uint64_t>(deviceSerial, [&](){ return get_APS(deviceSerial).get_mac_addr(); }, 0);
 }
 int set_mac_addr(const char * deviceSerial, uint64_t mac) {
-	return APSs[string(deviceSerial)].set_mac_addr(mac);
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).set_mac_addr(mac); });
 }
 const char * get_ip_addr(const char * deviceSerial) {
-	uint32_t ip_addr = APSs[string(deviceSerial)].get_ip_addr();
-	return asio::ip::address_v4(ip_addr).to_string().c_str();
+	//Kept per thread so the pointer handed back stays valid until the next call
+	static thread_local string ipAddrStr;
+	return catch_errors<const char *>(deviceSerial, [&](){
+		ipAddrStr = asio::ip::address_v4(get_APS(deviceSerial).get_ip_addr()).to_string();
+		return ipAddrStr.c_str();
+	}, nullptr);
 }
 int set_ip_addr(const char * deviceSerial, const char * ip_addr_str) {
-	uint32_t ip_addr = asio::ip::address_v4::from_string(ip_addr_str).to_ulong();
-	return APSs[string(deviceSerial)].set_ip_addr(ip_addr);
+	return catch_errors<int>(deviceSerial, [&](){
+		uint32_t ip_addr = asio::ip::address_v4::from_string(ip_addr_str).to_ulong();
+		return get_APS(deviceSerial).set_ip_addr(ip_addr);
+	});
 }
 int write_SPI_setup(const char * deviceSerial) {
-	return APSs[string(deviceSerial)].write_SPI_setup();
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).write_SPI_setup(); });
+}
+
+int set_ack_window(const char * deviceSerial, int window) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().set_ack_window(device_handle(deviceSerial), window); });
+}
+int get_ack_window(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().get_ack_window(device_handle(deviceSerial)); });
+}
+int set_ack_every(const char * deviceSerial, int numPackets) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().set_ack_every(device_handle(deviceSerial), std::max(numPackets, 1)); });
+}
+int get_ack_every(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().get_ack_every(device_handle(deviceSerial)); });
+}
+
+int set_pacing(const char * deviceSerial, int adaptive, double packetGapUS) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().set_pacing(device_handle(deviceSerial), adaptive, packetGapUS); });
+}
+int set_streaming(const char * deviceSerial, int enable) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().set_streaming(device_handle(deviceSerial), enable); });
+}
+int get_streaming(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().get_streaming(device_handle(deviceSerial)); });
+}
+
+int set_max_payload(const char * deviceSerial, int numWords) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().set_max_payload(device_handle(deviceSerial), std::max(numWords, 1)); });
+}
+
+int get_max_payload(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().get_max_payload(device_handle(deviceSerial)); });
+}
+
+int probe_max_payload(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).probe_max_payload(); });
+}
+
+int calibrate_transport(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return get_APS(deviceSerial).calibrate_transport(); });
+}
+
+int save_transport_profiles(const char * fileName) {
+	return APSEthernet::get_instance().save_transport_profiles(string(fileName)) ? APS_OK : APS_FILE_ERROR;
+}
+
+int load_transport_profiles(const char * fileName) {
+	return APSEthernet::get_instance().load_transport_profiles(string(fileName)) ? APS_OK : APS_FILE_ERROR;
+}
+
+int set_transport(int backend) {
+	return APSEthernet::get_instance().set_transport(APSEthernet::TransportBackend(backend));
+}
+int get_transport() {
+	return APSEthernet::get_instance().get_transport();
+}
+
+int set_packet_transport(const char * interface) {
+	return APSEthernet::get_instance().set_transport(APSEthernet::PACKET_MMAP_TRANSPORT, interface ? string(interface) : string());
+}
+
+int set_device_sockets(int enable, int dedicatedThreads, int firstCore) {
+	return APSEthernet::get_instance().set_device_sockets(enable != 0, dedicatedThreads != 0, firstCore);
+}
+
+int set_interfaces(int enable, const char ** interfaces, int numInterfaces) {
+	vector<string> names;
+	for (int ct = 0; ct < numInterfaces; ct++) {
+		names.push_back(interfaces[ct]);
+	}
+	return APSEthernet::get_instance().set_interfaces(enable != 0, names);
+}
+
+int set_low_latency(int enable, int receiveCore, int busyPollUS) {
+	return APSEthernet::get_instance().set_low_latency(enable != 0, receiveCore, std::max(busyPollUS, 0));
+}
+int get_low_latency() {
+	return APSEthernet::get_instance().get_low_latency();
+}
+
+int set_socket_buffers(int receiveBytes, int sendBytes) {
+	return APSEthernet::get_instance().set_socket_buffers(receiveBytes, sendBytes);
+}
+
+int set_retransmit_limits(const char * deviceSerial, double minTimeoutMS, double maxTimeoutMS, int maxRetries) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().set_retransmit_limits(device_handle(deviceSerial), minTimeoutMS, maxTimeoutMS, std::max(maxRetries, 0)); });
+}
+
+double get_round_trip_time(const char * deviceSerial) {
+	return catch_errors<double>(deviceSerial, [&](){ return APSEthernet::get_instance().get_round_trip_time(device_handle(deviceSerial)); });
+}
+
+double get_retransmit_timeout(const char * deviceSerial) {
+	return catch_errors<double>(deviceSerial, [&](){ return APSEthernet::get_instance().get_retransmit_timeout(device_handle(deviceSerial)); });
+}
+
+uint64_t get_timeout_count(const char * deviceSerial) {
+	return catch_errors<uint64_t>(deviceSerial, [&](){ return APSEthernet::get_instance().get_timeout_count(device_handle(deviceSerial)); }, 0);
+}
+
+uint64_t get_retransmit_count(const char * deviceSerial) {
+	return catch_errors<uint64_t>(deviceSerial, [&](){ return APSEthernet::get_instance().get_retransmit_count(device_handle(deviceSerial)); }, 0);
+}
+
+uint64_t get_kernel_drops(const char * deviceSerial) {
+	return catch_errors<uint64_t>(deviceSerial, [&](){ return APSEthernet::get_instance().get_kernel_drops(device_handle(deviceSerial)); }, 0);
+}
+
+static_assert(APS_RTT_HISTOGRAM_BUCKETS == NUM_RTT_BUCKETS, "APS_RTT_HISTOGRAM_BUCKETS must match the driver's histogram");
+
+int get_transport_stats(const char * deviceSerial, APSTransportStats * stats) {
+	TransportStats driverStats;
+	try {
+		driverStats = APSEthernet::get_instance().get_transport_stats(device_handle(deviceSerial));
+	} catch (std::exception & e) {
+		FILE_LOG(logERROR) << "Call on " << deviceSerial << " failed: " << e.what();
+		return APS_UNKNOWN_ERROR;
+	}
+	stats->packetsSent = driverStats.packetsSent;
+	stats->bytesSent = driverStats.bytesSent;
+	stats->packetsReceived = driverStats.packetsReceived;
+	stats->bytesReceived = driverStats.bytesReceived;
+	stats->retransmits = driverStats.retransmits;
+	stats->timeouts = driverStats.timeouts;
+	std::copy(driverStats.rttHistogram, driverStats.rttHistogram + NUM_RTT_BUCKETS, stats->rttHistogram);
+	stats->maxReceiveQueueDepth = driverStats.maxReceiveQueueDepth;
+	stats->maxPendingRequests = driverStats.maxPendingRequests;
+	stats->maxChunksInFlight = driverStats.maxChunksInFlight;
+	stats->numUploads = driverStats.numUploads;
+	stats->uploadBytes = driverStats.uploadBytes;
+	stats->uploadMicroseconds = driverStats.uploadMicroseconds;
+	stats->lastUploadBytes = driverStats.lastUploadBytes;
+	stats->lastUploadMicroseconds = driverStats.lastUploadMicroseconds;
+	stats->deviceOverruns = driverStats.deviceOverruns;
+	stats->packetGapNanoseconds = driverStats.packetGapNanoseconds;
+	return APS_OK;
+}
+
+int reset_transport_stats(const char * deviceSerial) {
+	return catch_errors<int>(deviceSerial, [&](){ return APSEthernet::get_instance().reset_transport_stats(device_handle(deviceSerial)); });
+}
+
+//Copies the data before returning so the caller's buffer can be reused straight away
+int write_memory_async(const char * deviceSerial, uint32_t addr, uint32_t* data, uint32_t numWords, APSCompletionCallback callback, void * userData) {
+	vector<uint32_t> dataVec(data, data+numWords);
+	return run_with_callback(deviceSerial, [addr, dataVec](APS2 & aps){ return aps.write_memory(addr, dataVec); }, callback, userData);
+}
+
+//data must stay valid until the callback has been called
+int read_memory_async(const char * deviceSerial, uint32_t addr, uint32_t* data, uint32_t numWords, APSCompletionCallback callback, void * userData) {
+	return run_with_callback(deviceSerial, [addr, data, numWords](APS2 & aps){
+		auto readData = aps.read_memory(addr, numWords);
+		std::copy(readData.begin(), readData.end(), data);
+		return 0;
+	}, callback, userData);
+}
+
+//value must stay valid until the callback has been called
+int read_SPI_async(const char * deviceSerial, int target, int addr, uint32_t * value, APSCompletionCallback callback, void * userData) {
+	string serial(deviceSerial);
+	std::shared_ptr<APS2> aps = get_APS_ptr(serial);
+	auto store = [value](uint32_t result){ *value = result; };
+	return catch_errors<int>(deviceSerial, [&](){
+		aps->read_SPI_async(CHIPCONFIG_IO_TARGET(target), addr, query_callback<uint32_t>(serial, aps, store, callback, userData));
+		return APS_OK;
+	});
+}
+
+//statusRegs must hold APS_STATUS_REGISTERS words and stay valid until the callback has been called
+int read_status_registers_async(const char * deviceSerial, uint32_t * statusRegs, APSCompletionCallback callback, void * userData) {
+	string serial(deviceSerial);
+	std::shared_ptr<APS2> aps = get_APS_ptr(serial);
+	auto store = [statusRegs](const APSStatusBank_t & result){ std::copy(result.array, result.array + APS_STATUS_REGISTERS, statusRegs); };
+	return catch_errors<int>(deviceSerial, [&](){
+		aps->read_status_registers_async(query_callback<APSStatusBank_t>(serial, aps, store, callback, userData));
+		return APS_OK;
+	});
+}
+
+static_assert(APS_STATUS_REGISTERS == sizeof(APSStatusBank_t::array) / sizeof(uint32_t), "APS_STATUS_REGISTERS must match the status bank");
+
+int set_waveform_float_async(const char * deviceSerial, int channelNum, float* data, int numPts, APSCompletionCallback callback, void * userData) {
+	vector<float> waveform(data, data+numPts);
+	return run_with_callback(deviceSerial, [channelNum, waveform](APS2 & aps){ return aps.set_waveform(channelNum, waveform); }, callback, userData);
+}
+
+int set_waveform_int_async(const char * deviceSerial, int channelNum, int16_t* data, int numPts, APSCompletionCallback callback, void * userData) {
+	vector<int16_t> waveform(data, data+numPts);
+	return run_with_callback(deviceSerial, [channelNum, waveform](APS2 & aps){ return aps.set_waveform(channelNum, waveform); }, callback, userData);
 }
 
 #ifdef __cplusplus
 }
 #endif
-
@@ -30,6 +30,7 @@ EXPORT int init();
 EXPORT int init_nolog();
 
 EXPORT int enumerate_devices();
+EXPORT int set_enumerate_options(int, uint64_t*, int, int);
 EXPORT int get_numDevices();
 EXPORT void get_deviceSerials(const char **);
 
@@ -86,6 +87,7 @@ EXPORT int set_logging_level(int);
 EXPORT int write_memory(const char *, uint32_t, uint32_t*, uint32_t);
 EXPORT int read_memory(const char *, uint32_t, uint32_t*, uint32_t);
 EXPORT int read_register(const char *, uint32_t);
+EXPORT int read_registers(const char *, uint32_t*, uint32_t*, uint32_t);
 EXPORT int program_FPGA(const char *, const char *);
 
 EXPORT int write_flash(const char *, uint32_t, uint32_t*, uint32_t);
@@ -98,6 +100,77 @@ EXPORT int set_ip_addr(const char *, const char *);
 
 EXPORT int write_SPI_setup(const char *);
 
+EXPORT int set_ack_window(const char *, int);
+EXPORT int get_ack_window(const char *);
+EXPORT int set_ack_every(const char *, int);
+EXPORT int get_ack_every(const char *);
+
+EXPORT int set_pacing(const char *, int, double);
+EXPORT int set_streaming(const char *, int);
+EXPORT int get_streaming(const char *);
+
+EXPORT int set_max_payload(const char *, int);
+EXPORT int get_max_payload(const char *);
+EXPORT int probe_max_payload(const char *);
+
+EXPORT int calibrate_transport(const char *);
+EXPORT int save_transport_profiles(const char *);
+EXPORT int load_transport_profiles(const char *);
+
+EXPORT int set_transport(int);
+EXPORT int get_transport();
+EXPORT int set_packet_transport(const char *);
+EXPORT int set_device_sockets(int, int, int);
+EXPORT int set_interfaces(int, const char **, int);
+EXPORT int set_low_latency(int, int, int);
+EXPORT int get_low_latency();
+EXPORT int set_socket_buffers(int, int);
+
+EXPORT int set_retransmit_limits(const char *, double, double, int);
+EXPORT double get_round_trip_time(const char *);
+EXPORT double get_retransmit_timeout(const char *);
+EXPORT uint64_t get_timeout_count(const char *);
+EXPORT uint64_t get_retransmit_count(const char *);
+EXPORT uint64_t get_kernel_drops(const char *);
+
+/* transport statistics; see the API reference for the round trip histogram buckets */
+#define APS_RTT_HISTOGRAM_BUCKETS 12
+typedef struct {
+	uint64_t packetsSent;
+	uint64_t bytesSent;
+	uint64_t packetsReceived;
+	uint64_t bytesReceived;
+	uint64_t retransmits;
+	uint64_t timeouts;
+	uint64_t rttHistogram[APS_RTT_HISTOGRAM_BUCKETS];
+	uint64_t maxReceiveQueueDepth;
+	uint64_t maxPendingRequests;
+	uint64_t maxChunksInFlight;
+	uint64_t numUploads;
+	uint64_t uploadBytes;
+	uint64_t uploadMicroseconds;
+	uint64_t lastUploadBytes;
+	uint64_t lastUploadMicroseconds;
+	uint64_t deviceOverruns;
+	uint64_t packetGapNanoseconds;
+} APSTransportStats;
+
+EXPORT int get_transport_stats(const char *, APSTransportStats *);
+EXPORT int reset_transport_stats(const char *);
+
+/* asynchronous methods; these return immediately and call back with the result once the operation completes.
+ * They share a fixed pool of driver threads and operations on one APS2 run in the order they were started. The SPI
+ * and status reads don't hold a thread while they wait on the device; memory transfers and waveform uploads do. */
+typedef void (*APSCompletionCallback)(const char * deviceSerial, int result, void * userData);
+
+EXPORT int write_memory_async(const char *, uint32_t, uint32_t*, uint32_t, APSCompletionCallback, void *);
+EXPORT int read_memory_async(const char *, uint32_t, uint32_t*, uint32_t, APSCompletionCallback, void *);
+EXPORT int read_SPI_async(const char *, int, int, uint32_t*, APSCompletionCallback, void *);
+#define APS_STATUS_REGISTERS 16
+EXPORT int read_status_registers_async(const char *, uint32_t*, APSCompletionCallback, void *);
+EXPORT int set_waveform_float_async(const char *, int, float*, int, APSCompletionCallback, void *);
+EXPORT int set_waveform_int_async(const char *, int, int16_t*, int, APSCompletionCallback, void *);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""
+Stand-in APS2 for testing the driver's transports without hardware.
+
+Listens on the APS2 UDP port and speaks enough of the protocol for the driver's upload and read paths:
+acknowledges writes (unless sent NACK), answers user I/O reads from a sparse memory, answers status and enumerate
+requests with a status bank, and keeps the sequence skip/duplicate and received packet counters the driver reads.
+Packets after a sequence gap are answered with the SEQ bit set even when they asked for no acknowledge, as the
+firmware does.
+
+Environment:
+    LOSS      fraction of incoming packets to drop
+    ACKLOSS   fraction of replies to drop (defaults to LOSS)
+"""
+import os
+import random
+import socket
+import struct
+
+APS_PROTO = 0xBB4E
+MAC = b'\x00\x11\x22\x33\x44\x55'
+
+# Command nibble values, see APS_COMMANDS in constants.h
+RESET, USERIO, EPROMIO, CHIPCONFIGIO, RUNCHIPCONFIG, FPGACONFIG, FPGACONFIG_CTRL, STATUS = range(8)
+
+# Status bank offsets, see APSStatusBank_t in constants.h
+SEND_PACKET_COUNT, RECEIVE_PACKET_COUNT, SEQUENCE_SKIP_COUNT, SEQUENCE_DUP_COUNT = 8, 9, 10, 11
+
+PLL_STATUS_ADDR = 0x44A00000
+
+loss = float(os.environ.get('LOSS', '0'))
+ackLoss = float(os.environ.get('ACKLOSS', str(loss)))
+
+memory = {PLL_STATUS_ADDR: 0x7}
+flash = {}
+status = [0] * 16
+status[0] = 0x000A0001
+status[1] = 0xA03
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+sock.bind(('0.0.0.0', APS_PROTO))
+
+lastSeq = None
+while True:
+    data, sender = sock.recvfrom(4096)
+    if loss and random.random() < loss:
+        continue
+    status[RECEIVE_PACKET_COUNT] += 1
+
+    dest, src, frameType, seq, command = struct.unpack('>6s6sHHI', data[:20])
+    cmd = (command >> 24) & 0x7
+    noAck = (command >> 27) & 0x1
+    read = (command >> 28) & 0x1
+    mode = (command >> 16) & 0xFF
+    cnt = command & 0xFFFF
+
+    seqError = None
+    if lastSeq is not None and seq != (lastSeq + 1) & 0xFFFF:
+        if seq == lastSeq:
+            status[SEQUENCE_DUP_COUNT] += 1
+            seqError = 0
+        else:
+            status[SEQUENCE_SKIP_COUNT] += 1
+            seqError = 1
+    lastSeq = seq
+
+    payload = []
+    reply = not noAck
+    if cmd in (STATUS, RESET):
+        payload = status[:]
+        reply = True
+    else:
+        addr = struct.unpack('>I', data[20:24])[0]
+        numWords = (len(data) - 24) // 4
+        words = struct.unpack('>%dI' % numWords, data[24:24 + 4 * numWords])
+        if cmd == USERIO:
+            if read:
+                payload = [memory.get(addr + 4 * ct, 0) for ct in range(cnt)]
+            else:
+                for ct in range(cnt):
+                    memory[addr + 4 * ct] = words[ct]
+        elif cmd == EPROMIO:
+            if read:
+                payload = [flash.get(addr + 4 * ct, 0xFFFFFFFF) for ct in range(cnt)]
+            elif mode == 0:
+                for ct in range(cnt):
+                    flash[addr + 4 * ct] = words[ct]
+        elif cmd == CHIPCONFIGIO and read:
+            payload = [0]
+
+    if seqError is not None:
+        command = (command & ~(0xFF << 16)) | (1 << 30) | (seqError << 16)
+        if not reply:
+            payload = []
+        reply = True
+    if not reply or (ackLoss and random.random() < ackLoss):
+        continue
+    out = struct.pack('>6s6sHHI', src, MAC, APS_PROTO, seq, command | (1 << 31))
+    out += b''.join(struct.pack('>I', word & 0xFFFFFFFF) for word in payload)
+    status[SEND_PACKET_COUNT] += 1
+    sock.sendto(out, sender)
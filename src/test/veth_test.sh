@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# Run a test program against the stand-in APS2 over a veth pair, without hardware or root.
+#
+# Creates a private network namespace holding the host end of a veth pair (10.0.0.1) and a second one holding the
+# responder end (10.0.0.2) with aps2_responder.py listening on it, then runs the command given in the first. Needs
+# unprivileged user namespaces. Inside them the process has CAP_NET_RAW, so the packet ring transport works too.
+#
+# usage: veth_test.sh <command...>
+#   e.g. veth_test.sh ./transport_test --transport 2
+# LOSS and ACKLOSS are passed through to the responder.
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+RUNDIR=$(mktemp -d)
+trap 'rm -rf "$RUNDIR"' EXIT
+export HERE RUNDIR
+
+unshare -rn bash -s -- "$@" <<'SCRIPT'
+ip link add aps0 type veth peer name aps1
+ip addr add 10.0.0.1/24 dev aps0
+ip link set aps0 up
+ip link set lo up
+#Enumeration broadcasts to 255.255.255.255, which needs a route
+ip route add default dev aps0
+
+#The responder's namespace waits for its end of the pair before configuring it
+unshare -n bash -c 'echo $$ > "$RUNDIR/pid"
+    while [ ! -e "$RUNDIR/ready" ]; do sleep 0.02; done
+    ip addr add 10.0.0.2/24 dev aps1; ip link set aps1 up; ip link set lo up
+    ip route add default dev aps1
+    exec python3 "$HERE/aps2_responder.py"' &
+while [ ! -s "$RUNDIR/pid" ]; do sleep 0.02; done
+ip link set aps1 netns "$(cat "$RUNDIR/pid")"
+touch "$RUNDIR/ready"
+sleep 0.5
+
+"$@"
+result=$?
+kill %1 2>/dev/null
+exit $result
+SCRIPT
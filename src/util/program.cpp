@@ -79,20 +79,17 @@ int write_image(string deviceSerial, string fileName) {
     return -1;
   }
   write_flash(deviceSerial.c_str(), EPROM_USER_IMAGE_ADDR, data.data(), data.size());
-  //verify the write
-  vector<uint32_t> buffer(256);
-  uint32_t numWords = 256;
+  //verify the write; read_flash pipelines the reads so fetch large blocks and just report progress between them
+  const size_t blockSize = 1 << 16;
+  vector<uint32_t> buffer(blockSize);
   cout << "Verifying:" << endl;
-  for (size_t ct=0; ct < data.size(); ct+=256) {
-    if (ct % 1000 == 0) {
-      cout << "\r" << 100*ct/data.size() << "%" << flush;
-    }
-    if (std::distance(data.begin() + ct, data.end()) < 256) {
-      numWords = std::distance(data.begin() + ct, data.end());
-    }
+  for (size_t ct=0; ct < data.size(); ct+=blockSize) {
+    cout << "\r" << 100*ct/data.size() << "%" << flush;
+    uint32_t numWords = std::min(blockSize, data.size() - ct);
     read_flash(deviceSerial.c_str(), EPROM_USER_IMAGE_ADDR + 4*ct, numWords, buffer.data());
-    if (!std::equal(buffer.begin(), buffer.begin()+numWords, data.begin()+ct)) {
-      cout << endl << "Mismatched data at offset " << hexn<6> << ct << endl;
+    auto mismatch = std::mismatch(buffer.begin(), buffer.begin()+numWords, data.begin()+ct);
+    if (mismatch.first != buffer.begin()+numWords) {
+      cout << endl << "Mismatched data at offset " << hexn<6> << ct + std::distance(buffer.begin(), mismatch.first) << endl;
       return -2;
     }
   }